@@ -0,0 +1,45 @@
+/* Template load benchmark.
+   Writes a few megabytes of template, mostly html text with a macro
+   now and then and a few blocks, and times loading it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "webtpl.h"
+
+#define NLINE 100000
+#define NLOAD 50
+
+int main(int argc, char **argv)
+{
+  WebTemplate W = WebTemplate_new();
+  FILE *f = fopen("load_bench.tpl", "w");
+  clock_t t0;
+  long size;
+  double ms;
+  int i;
+
+  for (i=0; i<NLINE; i++) {
+     if (i%1000==0) fprintf(f, "<!-- BDB: blk%d -->\n", i);
+     if (i%8) fprintf(f, "  <tr class=\"row\"><td>static line %d</td><td>of the page</td></tr>\n", i);
+     else fprintf(f, "  <tr><td>{MAC_%d}</td><td>{VAL_%d|html}</td></tr>\n", i%100, i%50);
+     if (i%1000==999) fprintf(f, "<!-- EDB: blk%d -->\n", i-999);
+  }
+  size = ftell(f);
+  fclose(f);
+
+  t0 = clock();
+  for (i=0; i<NLOAD; i++) {
+     if (WebTemplate_get_by_name(W, "page", "load_bench.tpl")) {
+        fprintf(stderr, "load failed: %s\n", WebTemplate_get_error_string(W));
+        return (1);
+     }
+  }
+  ms = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e3 / NLOAD;
+  printf("load %.1f MB: %8.2f ms, %6.0f MB/s\n", size/1e6, ms, size/1e3/ms);
+
+  remove("load_bench.tpl");
+  WebTemplate_free(W);
+  return (0);
+}
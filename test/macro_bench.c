@@ -0,0 +1,46 @@
+/* Macro assignment benchmark.
+   Assign cost should stay flat as the number of macros grows. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "webtpl.h"
+
+#define NASSIGN 2000000
+
+int main(int argc, char **argv)
+{
+  static int nmac[] = { 10, 100, 1000, 10000, 100000, 0 };
+  int *n;
+  int i;
+
+  printf("macros   ns/assign  ns/assign_h\n");
+  for (n=nmac; *n; n++) {
+     WebTemplate W = WebTemplate_new();
+     char **names = (char**) malloc(*n * sizeof(char*));
+     WebTemplateMacro *h = (WebTemplateMacro*) malloc(*n * sizeof(WebTemplateMacro));
+     clock_t t0;
+     double ns, nsh;
+
+     for (i=0; i<*n; i++) {
+        names[i] = (char*) malloc(16);
+        sprintf(names[i], "MAC_%d", i);
+        WebTemplate_assign(W, names[i], "x");
+        h[i] = WebTemplate_macro_handle(W, names[i]);
+     }
+     t0 = clock();
+     for (i=0; i<NASSIGN; i++) WebTemplate_assign(W, names[i % *n], "value");
+     ns = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e9 / NASSIGN;
+     t0 = clock();
+     for (i=0; i<NASSIGN; i++) WebTemplate_assign_h(W, h[i % *n], "value");
+     nsh = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e9 / NASSIGN;
+     printf("%6d   %8.1f     %8.1f\n", *n, ns, nsh);
+
+     for (i=0; i<*n; i++) free(names[i]);
+     free(names);
+     free(h);
+     WebTemplate_free(W);
+  }
+  return (0);
+}
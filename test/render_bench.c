@@ -0,0 +1,208 @@
+/* Template render benchmark.
+   Renders a long template, mostly text, with a macro every few lines,
+   to a macro, streamed, gzipped and as pieces to /dev/null, and
+   nested in two layouts, then a table of rows from
+   a dynamic block, a million rows as in the 1.11 scenario, with an
+   escaped cell, kept or streamed from a row source. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include "webtpl.h"
+
+#define NLINE 2000
+#define NRENDER 2000
+#define NROW 1000000
+
+/* A row source for the table, of NROW rows */
+
+static int next_row(WebTemplate W, void *ctx)
+{
+  int *n = (int*) ctx;
+  return ((*n)++ < NROW);
+}
+
+int main(int argc, char **argv)
+{
+  WebTemplate W = WebTemplate_new();
+  FILE *f = tmpfile();
+  clock_t t0;
+  double us, ns;
+  struct iovec *iov;
+  int i, j, n, fd;
+
+  for (i=0; i<NLINE; i++) {
+     if (i%10) fprintf(f, "<tr><td>static line %d of the page</td></tr>\n", i);
+     else fprintf(f, "<tr><td>{MAC_%d}</td></tr>\n", i/10);
+  }
+  rewind(f);
+  WebTemplate_get_by_fp(W, "page", f);
+  fclose(f);
+  for (i=0; i<NLINE/10; i++) {
+     char name[16];
+     sprintf(name, "MAC_%d", i);
+     WebTemplate_assign(W, name, "value");
+  }
+
+  t0 = clock();
+  for (i=0; i<NRENDER; i++) WebTemplate_parse(W, "PAGE", "page");
+  us = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e6 / NRENDER;
+  printf("render %d lines: %8.1f us\n", NLINE, us);
+
+  WebTemplate_set_output(W, open("/dev/null", O_WRONLY));
+  WebTemplate_header(W);
+  t0 = clock();
+  for (i=0; i<NRENDER; i++) {
+     WebTemplate_parse(W, "PAGE", "page");
+     WebTemplate_write(W, "PAGE");
+  }
+  us = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e6 / NRENDER;
+  printf("parse and write:  %8.1f us\n", us);
+
+  t0 = clock();
+  for (i=0; i<NRENDER; i++) WebTemplate_write_template(W, "page");
+  us = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e6 / NRENDER;
+  printf("write_template:   %8.1f us\n", us);
+
+  fd = open("/dev/null", O_WRONLY);
+  t0 = clock();
+  for (i=0; i<NRENDER; i++) {
+     WebTemplate_render_iov(W, "page", &iov, &n);
+     writev(fd, iov, n);
+  }
+  us = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e6 / NRENDER;
+  printf("render_iov, writev:%7.1f us\n", us);
+
+  setenv("HTTP_ACCEPT_ENCODING", "gzip", 1);
+  WebTemplate_set_compression(W, 6);
+  t0 = clock();
+  for (i=0; i<NRENDER/10; i++) {
+     WebTemplate_reset_output(W);
+     WebTemplate_write_template(W, "page");
+  }
+  us = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e6 / (NRENDER/10);
+  printf("write_template, gzip:%6.1f us\n", us);
+  WebTemplate_set_compression(W, 0);
+  WebTemplate_reset_output(W);
+  WebTemplate_set_noheader(W);
+
+  /* the page nested in two layouts, rendered now or deferred */
+  f = tmpfile();
+  fprintf(f, "<div class=\"main\">\n{BODY}\n</div>\n");
+  rewind(f);
+  WebTemplate_get_by_fp(W, "main", f);
+  fclose(f);
+  f = tmpfile();
+  fprintf(f, "<html><body>\n{MAIN}\n</body></html>\n");
+  rewind(f);
+  WebTemplate_get_by_fp(W, "layout", f);
+  fclose(f);
+  for (j=0; j<2; j++) {
+     WebTemplate_set_deferred(W, j);
+     t0 = clock();
+     for (i=0; i<NRENDER; i++) {
+        WebTemplate_parse(W, "BODY", "page");
+        WebTemplate_parse(W, "MAIN", "main");
+        WebTemplate_parse(W, "LAYOUT", "layout");
+        WebTemplate_write(W, "LAYOUT");
+     }
+     us = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e6 / NRENDER;
+     printf("nested, %s: %8.1f us\n", j? "deferred": "parsed  ", us);
+  }
+  WebTemplate_set_deferred(W, 0);
+
+  /* a menu that uses a few macros, parsed again from the cache */
+  f = tmpfile();
+  for (i=0; i<20; i++) fprintf(f, "<li><a href=\"/{DEPT|url}/%d\">{USER|html}, item %d of {COUNT}</a></li>\n", i, i);
+  rewind(f);
+  WebTemplate_get_by_fp(W, "menu", f);
+  fclose(f);
+  WebTemplate_assign(W, "DEPT", "Parts & Service");
+  WebTemplate_assign(W, "USER", "<b>J. Smith</b>");
+  WebTemplate_assign_long(W, "COUNT", 20);
+  for (j=0; j<2; j++) {
+     WebTemplate_set_cache(W, j? 1<<20: 0);
+     t0 = clock();
+     for (i=0; i<NRENDER*10; i++) WebTemplate_parse(W, "MENU", "menu");
+     us = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e6 / NRENDER / 10;
+     printf("menu, %s:   %8.2f us\n", j? "cached  ": "no cache", us);
+  }
+  WebTemplate_set_cache(W, 0);
+
+  f = tmpfile();
+  fprintf(f, "<table>\n<!-- BDB: list -->\n<tbody>\n");
+  fprintf(f, "<!-- BDB: row -->\n<tr><td>{CELL}</td><td>{NAME|html}</td></tr>\n<!-- EDB: row -->\n");
+  fprintf(f, "</tbody>\n<!-- EDB: list -->\n</table>\n");
+  rewind(f);
+  WebTemplate_get_by_fp(W, "table", f);
+  fclose(f);
+  WebTemplate_assign(W, "CELL", "cell");
+  WebTemplate_assign(W, "NAME", "Smith & Jones <sales>");
+
+  t0 = clock();
+  for (i=0; i<NROW; i++) WebTemplate_parse_dynamic(W, "table.list.row");
+  WebTemplate_parse_dynamic(W, "table.list");
+  WebTemplate_parse(W, "TABLE", "table");
+  ns = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e9 / NROW;
+  printf("%d rows by name:   %8.1f ns/row\n", NROW, ns);
+
+  /* rows assigned one at a time, and by column */
+  {
+     static char *cells[NROW], *names[NROW];
+     char *cols[] = { "CELL", "NAME" };
+     char **vals[] = { cells, names };
+     char *who[] = { "Smith & Jones <sales>", "Brown", "O'Neil", "Lee" };
+     for (i=0; i<NROW; i++) {
+        cells[i] = i%2? "odd": "even";
+        names[i] = who[i%4];
+     }
+     t0 = clock();
+     for (i=0; i<NROW; i++) {
+        WebTemplate_assign(W, "CELL", cells[i]);
+        WebTemplate_assign(W, "NAME", names[i]);
+        WebTemplate_parse_dynamic(W, "table.list.row");
+     }
+     ns = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e9 / NROW;
+     printf("%d rows assigned: %8.1f ns/row\n", NROW, ns);
+     WebTemplate_parse_dynamic(W, "table.list");
+     WebTemplate_parse(W, "TABLE", "table");
+     t0 = clock();
+     WebTemplate_parse_dynamic_rows(W, "table.list.row", cols, 2, vals, NULL, NROW);
+     ns = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e9 / NROW;
+     printf("%d rows by column: %8.1f ns/row\n", NROW, ns);
+     WebTemplate_parse_dynamic(W, "table.list");
+     WebTemplate_parse(W, "TABLE", "table");
+  }
+  WebTemplate_assign(W, "CELL", "cell");
+  WebTemplate_assign(W, "NAME", "Smith & Jones <sales>");
+
+  WebTemplateDynamic row = WebTemplate_dynamic_handle(W, "table.list.row");
+  t0 = clock();
+  for (i=0; i<NROW; i++) WebTemplate_parse_dynamic_h(W, row);
+  ns = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e9 / NROW;
+  printf("%d rows by handle: %8.1f ns/row\n", NROW, ns);
+  t0 = clock();
+  WebTemplate_parse_dynamic(W, "table.list");
+  WebTemplate_parse(W, "TABLE", "table");
+  us = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e3;
+  printf("  and the page:    %8.1f ms\n", us);
+
+  f = tmpfile();
+  fprintf(f, "<table>\n");
+  fprintf(f, "<!-- BDB: row -->\n<tr><td>{CELL}</td><td>{NAME|html}</td></tr>\n<!-- EDB: row -->\n");
+  fprintf(f, "</table>\n");
+  rewind(f);
+  WebTemplate_get_by_fp(W, "export", f);
+  fclose(f);
+  WebTemplate_set_row_source(W, "export.row", next_row, &i);
+  i = 0;
+  t0 = clock();
+  WebTemplate_write_template(W, "export");
+  ns = (double)(clock()-t0) / CLOCKS_PER_SEC * 1e9 / NROW;
+  printf("%d rows streamed:  %8.1f ns/row\n", NROW, ns);
+
+  WebTemplate_free(W);
+  return (0);
+}
@@ -63,5 +63,9 @@ arg3 = {A3}
 
 Value of AA: {AA}
 Value of CC: {CC}
+Value of RAW (html): {RAW|html}
+Value of RAW (url): {RAW|url}
+Value of RAW (js): "{RAW|js}"
+Not a filter: {RAW|b} {a|b}
 </html>
 #end of test1.tpl
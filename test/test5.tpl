@@ -0,0 +1,4 @@
+<div class="hdr">{TITLE|html} by {AUTHOR=nobody}</div>
+<!-- BDB: item -->
+<span>{ITEM}</span>
+<!-- EDB: item -->
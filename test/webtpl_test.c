@@ -1,9 +1,42 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 #include "webtpl.h"
 
+/* An output sink that keeps what it is sent */
+
+static char sink_text[4096];
+static size_t sink_len;
+static int sink_calls;
+
+static int sink(void *ctx, char *data, size_t len)
+{
+  if (sink_len+len >= sizeof(sink_text)) return (ENOSPC);
+  memcpy(sink_text+sink_len, data, len);
+  sink_len += len;
+  sink_calls++;
+  return (0);
+}
+
+/* A row source: one row per item, to a null */
+
+static int next_item(WebTemplate W, void *ctx)
+{
+  char ***item = (char***) ctx;
+  if (!**item) return (0);
+  WebTemplate_assign(W, "ITEM", *(*item)++);
+  return (1);
+}
+
 main(int argc, char **argv)
 {
   char *tpl;
@@ -11,6 +44,7 @@ main(int argc, char **argv)
   char **a2;
   char **z;
   int ret;
+  struct iovec *iov;
 
   fprintf(stderr, "webtpl test.\nlibrary version: %s\n", webtpl_version);
 
@@ -35,6 +69,7 @@ main(int argc, char **argv)
   WebTemplate_set_comments(W, "#", NULL);
   WebTemplate_get_by_name(W, "sub", "test2.tpl");
   WebTemplate_get_by_name(W, "sub3", "test3.tpl");
+  WebTemplate_save_image(W, "test.img");
 
   // open a second
   WebTemplate WW = newWebTemplate();
@@ -65,20 +100,24 @@ main(int argc, char **argv)
   
   WebTemplate_free(WW);
 
-  WebTemplate_assign(W, "AA", "aa");
-  WebTemplate_assign(W, "CC", "cc");
+  WebTemplate_assign_n(W, "AA", "aaxx", 2);
+  WebTemplate_assign_ref(W, "CC", "cc", 2);
   WebTemplate_parse(W, "SUB", "sub");
 
   WebTemplate_parse_dynamic(W, "sub3.dyn3");
   WebTemplate_parse(W, "SUB3", "sub3");
  
   WebTemplate_assign(W, "REPL", "replacement");
-  WebTemplate_assign(W, "EFGH", "999");
+  WebTemplate_assign_int(W, "EFGH", 999);
 
   WebTemplate_assign(W, "ABCD", "(111)");
   WebTemplate_parse_dynamic(W, "page.zzzz");
-  WebTemplate_assign(W, "ABCD", "(222)");
-  WebTemplate_parse_dynamic(W, "page.zzzz");
+  WebTemplateMacro abcd = WebTemplate_macro_handle(W, "ABCD");
+  WebTemplateDynamic zzzz = WebTemplate_dynamic_handle(W, "page.zzzz");
+  WebTemplate_assign_h(W, abcd, "(222)");
+  WebTemplate_parse_dynamic_h(W, zzzz);
+  if (WebTemplate_dynamic_handle(W, "page.zzzz")!=zzzz) printf("Dynamic handle not reused\n");
+  WebTemplate_free_dynamic_handle(W, zzzz);
 
   WebTemplate_assign(W, "_EFG", "(-efg-)");
   WebTemplate_parse_dynamic(W, "page.abc_d.efg");
@@ -103,20 +142,385 @@ main(int argc, char **argv)
   v = WebTemplate_text2html("<br>&heloo CC <br>");
   WebTemplate_assign(W, "CC", v);
   free(v);
+  WebTemplate_assign(W, "RAW", "<br>&heloo 'CC' <br>\n");
   WebTemplate_set_cookie(W, "ck2", "ck2's value",
       0, NULL, "/fox/", 0);
   WebTemplate_parse(W, "PAGE", "page");
   WebTemplate_write(W, "PAGE");
 
-  /* Send a text only page */
+  /* Lines are not limited in length */
+
+  FILE *lf = tmpfile();
+  for (ret=0; ret<10000; ret++) fputc('x', lf);
+  fputs("{EFGH}\n", lf);
+  rewind(lf);
+  WebTemplate_get_by_fp(W, "long", lf);
+  fclose(lf);
+  WebTemplate_parse(W, "LONG", "long");
+  v = WebTemplate_macro_value(W, "LONG");
+  printf("\nLong line: %d, ends %s", (int)strlen(v), v+strlen(v)-4);
+  fflush(stdout);
+  free(v);
+
+  /* The same templates from a compiled image */
+
+  WebTemplate WI = WebTemplate_new();
+  ret = WebTemplate_load_image(WI, "test.img");
+  WebTemplate_assign_n(WI, "AA", "aa", 2);
+  WebTemplate_assign_ref(WI, "CC", "cc", 2);
+  WebTemplate_parse(WI, "SUB", "sub");
+  WebTemplate_parse_dynamic(WI, "sub3.dyn3");
+  WebTemplate_parse(WI, "SUB3", "sub3");
+  char *vi = WebTemplate_macro_value(WI, "SUB");
+  v = WebTemplate_macro_value(W, "SUB");
+  printf("Image load: (%d), sub %s", ret, strcmp(v, vi)? "differs": "same");
+  free(v);
+  free(vi);
+  vi = WebTemplate_macro_value(WI, "SUB3");
+  v = WebTemplate_macro_value(W, "SUB3");
+  printf(", sub3 %s\n", strcmp(v, vi)? "differs": "same");
+  fflush(stdout);
+  free(v);
+  free(vi);
+  WebTemplate_free(WI);
+  /* An instance sharing the templates */
+
+  WebTemplateSet S = WebTemplate_get_set(W);
+  WebTemplate WS = WebTemplate_new_with_set(S);
+  WebTemplate_free_set(S);
+  WebTemplate_assign_n(WS, "AA", "aa", 2);
+  WebTemplate_assign_ref(WS, "CC", "cc", 2);
+  WebTemplate_parse(WS, "SUB", "sub");
+  WebTemplate_parse_dynamic(WS, "sub3.dyn3");
+  WebTemplate_parse(WS, "SUB3", "sub3");
+  vi = WebTemplate_macro_value(WS, "SUB");
+  v = WebTemplate_macro_value(W, "SUB");
+  printf("Shared set: sub %s", strcmp(v, vi)? "differs": "same");
+  free(v);
+  free(vi);
+  vi = WebTemplate_macro_value(WS, "SUB3");
+  v = WebTemplate_macro_value(W, "SUB3");
+  printf(", sub3 %s\n", strcmp(v, vi)? "differs": "same");
+  fflush(stdout);
+  free(v);
+  free(vi);
+
+  /* Keep rendered parses by the values they used */
+
+  {
+     unsigned long hits, misses;
+     WebTemplate_set_cache(WS, 4096);
+     WebTemplate_parse(WS, "SUB", "sub");
+     WebTemplate_parse(WS, "SUB", "sub");
+     vi = WebTemplate_macro_value(WS, "SUB");
+     v = WebTemplate_macro_value(W, "SUB");
+     WebTemplate_assign(WS, "AA", "changed");
+     WebTemplate_parse(WS, "SUB", "sub");
+     WebTemplate_parse_dynamic(WS, "sub3.dyn3");
+     WebTemplate_parse(WS, "SUB3", "sub3");
+     WebTemplate_get_cache_stats(WS, &hits, &misses);
+     printf("Cache: sub %s, %lu hits, %lu misses\n", strcmp(v, vi)? "differs": "same",
+        hits, misses);
+     fflush(stdout);
+     free(v);
+     free(vi);
+  }
+
+  /* Typed values assigned before a template is bound are kept */
+
+  {
+     FILE *tf = fopen("typed.tpl", "w");
+     fputs("n={N=0} x={X=1}\n", tf);
+     fclose(tf);
+     WebTemplate_get_by_name(W, "typed", "typed.tpl");
+     WebTemplate_assign_long(WS, "N", 42);
+     WebTemplate_assign_double(WS, "X", 2.5, 1);
+     WebTemplate_parse(WS, "TYPED", "typed");
+     v = WebTemplate_macro_value(WS, "TYPED");
+     printf("Typed before bind: %s", v);
+     fflush(stdout);
+     free(v);
+     unlink("typed.tpl");
+  }
+
+  /* Typed values are formatted when used */
+
+  {
+     char lbuf[32];
+     char *tv[6];
+     int i;
+     setenv("TZ", "UTC0", 1);
+     tzset();
+     WebTemplate_assign_long(W, "TV", -42);
+     tv[0] = WebTemplate_macro_value(W, "TV");
+     WebTemplate_assign_long(W, "TV", LONG_MIN);
+     tv[1] = WebTemplate_macro_value(W, "TV");
+     WebTemplate_assign_double(W, "TV", 2.7, 0);
+     tv[2] = WebTemplate_macro_value(W, "TV");
+     WebTemplate_assign_double(W, "TV", -1.25, 2);
+     tv[3] = WebTemplate_macro_value(W, "TV");
+     WebTemplate_assign_double(W, "TV", 1.5e300, 2);
+     tv[4] = WebTemplate_macro_value(W, "TV");
+     WebTemplate_assign_time(W, "TV", (time_t)86400*366, "%Y-%m-%d %H:%M");
+     tv[5] = WebTemplate_macro_value(W, "TV");
+     snprintf(lbuf, sizeof(lbuf), "%ld", LONG_MIN);
+     printf("Typed: %s, LONG_MIN %s, %s, %s, %s, %s\n", tv[0],
+        strcmp(tv[1], lbuf)? "differs": "same", tv[2], tv[3], tv[4], tv[5]);
+     fflush(stdout);
+     for (i=0; i<6; i++) free(tv[i]);
+     unsetenv("TZ");
+     tzset();
+  }
+  WebTemplate_free(WS);
+
+  /* Reload a template whose file changed */
+
+  FILE *rf = fopen("reload.tpl", "w");
+  fputs("first {EFGH}\n", rf);
+  fclose(rf);
+  WebTemplate_get_by_name(W, "rl", "reload.tpl");
+  WebTemplate_set_reload(W, 1);
+  rf = fopen("reload.tpl", "w");
+  fputs("second version {EFGH}\n", rf);
+  fclose(rf);
+  sleep(1);
+  WebTemplate_parse(W, "RL", "rl");
+  v = WebTemplate_macro_value(W, "RL");
+  printf("Reloaded: %s", v);
+  fflush(stdout);
+  free(v);
+  WebTemplate_set_reload(W, 0);
+  unlink("reload.tpl");
+
+  /* Include a partial when loading */
+
+  rf = fopen("include.tpl", "w");
+  fputs("<body>\n  <!-- INCLUDE: test5.tpl -->\n</body>\n", rf);
+  fclose(rf);
+  WebTemplate_get_by_name(W, "inc", "include.tpl");
+  WebTemplate_assign(W, "TITLE", "a<b");
+  WebTemplate_assign(W, "ITEM", "one");
+  WebTemplate_parse_dynamic(W, "inc.item");
+  WebTemplate_parse(W, "INC", "inc");
+  v = WebTemplate_macro_value(W, "INC");
+  printf("Included: %s", v);
+  free(v);
+
+  /* The same include read with other comment markers, under
+     an includer that has its own default, named with no space
+     before the end of the comment */
+
+  rf = fopen("part.tpl", "w");
+  fputs("# part comment\n<p>{WHO=part}</p>\n", rf);
+  fclose(rf);
+  rf = fopen("include2.tpl", "w");
+  fputs("by {WHO=mine}\n<!-- INCLUDE: part.tpl-->\n", rf);
+  fclose(rf);
+  WebTemplate_get_by_name(W, "inch", "include2.tpl");
+  WebTemplate_set_comments(W, "%", NULL);
+  WebTemplate_get_by_name(W, "incp", "include2.tpl");
+  WebTemplate_set_comments(W, "#", NULL);
+  WebTemplate_parse(W, "INC", "inch");
+  v = WebTemplate_macro_value(W, "INC");
+  printf("Include markers #: %s", v);
+  free(v);
+  WebTemplate_parse(W, "INC", "incp");
+  v = WebTemplate_macro_value(W, "INC");
+  printf("Include markers %%: %s", v);
+  free(v);
+  unlink("part.tpl");
+  unlink("include2.tpl");
+  WebTemplate_parse_dynamic(W, "inc.item");
+  WebTemplate_parse_dynamic(W, "inc.item");
+  printf("Streamed: ");
+  fflush(stdout);
+  WebTemplate_write_template(W, "inc");
+
+  /* Write to a sink, through a small buffer */
+
+  WebTemplate_set_sink(W, sink, NULL);
+  WebTemplate_set_output_buffer(W, 256);
+  for (ret=0; ret<20; ret++) WebTemplate_parse_dynamic(W, "inc.item");
+  WebTemplate_write_template(W, "inc");
+  WebTemplate_set_output(W, 1);
+  WebTemplate_set_output_buffer(W, 16384);
+  sink_text[sink_len] = '\0';
+  printf("Sink: %d bytes in %d calls, ends %s", (int)sink_len, sink_calls,
+         sink_text+sink_len-8);
+
+  /* Defer a parse, which keeps the values it was parsed with */
+
+  WebTemplate_set_deferred(W, 1);
+  WebTemplate_parse_dynamic(W, "inc.item");
+  WebTemplate_parse(W, "INC", "inc");
+  WebTemplate_assign(W, "TITLE", "c>d");
+  v = WebTemplate_macro_value(W, "INC");
+  printf("Deferred: %s", v);
+  free(v);
+  WebTemplate_set_deferred(W, 0);
+
+  /* Render to pieces, sent as they are with writev */
+
+  WebTemplate_parse_dynamic(W, "inc.item");
+  WebTemplate_render_iov(W, "inc", &iov, &ret);
+  printf("Pieces: %d\n", ret);
+  fflush(stdout);
+  writev(1, iov, ret);
+
+  /* Parse a block's rows from a table kept by column */
+
+  {
+     char *col[] = { "ITEM" };
+     char *items[] = { "two", NULL, "three-ish" };
+     size_t lens[] = { 3, 0, 5 };
+     char *col2[] = { NULL, "ITEM" };   /* a column skipped */
+     char **vals[] = { items };
+     char **vals2[] = { NULL, items };
+     size_t *lenv[] = { lens };
+     WebTemplate_parse_dynamic_rows(W, "inc.item", col, 1, vals, lenv, 3);
+     WebTemplate_parse_dynamic_rows(W, "inc.item", col2, 2, vals2, NULL, 3);
+  }
+  WebTemplate_parse(W, "INC", "inc");
+  v = WebTemplate_macro_value(W, "INC");
+  printf("Rows: %s", v);
+  free(v);
+
+  /* Stream a block's rows from a source as they are made */
+
+  {
+     char *items[] = { "four", "five", NULL };
+     char **item = items;
+     WebTemplate_set_row_source(W, "inc.item", next_item, &item);
+     printf("Row source: ");
+     fflush(stdout);
+     WebTemplate_write_template(W, "inc");
+     item = items;
+     WebTemplate_reset_output(W);
+     WebTemplate_set_content_length(W, 1);
+     WebTemplate_set_etag(W, 1);
+     WebTemplate_set_sink(W, sink, NULL);
+     sink_len = 0;
+     WebTemplate_write_template(W, "inc");
+     WebTemplate_set_output(W, 1);
+     WebTemplate_set_content_length(W, 0);
+     WebTemplate_set_etag(W, 0);
+     sink_text[sink_len] = '\0';
+     printf("Row source with a length and tag: %s, %s, %d rows\n",
+        strstr(sink_text, "Content-Length")? "sized": "streamed",
+        strstr(sink_text, "ETag")? "tagged": "untagged",
+        !!strstr(sink_text, "four")+!!strstr(sink_text, "five"));
+     {
+        struct iovec *iov;
+        int n;
+        ret = WebTemplate_render_iov(W, "inc", &iov, &n);
+        printf("Row source pieces: (%d) %s\n", ret, WebTemplate_get_error_string(W));
+     }
+     WebTemplate_set_row_source(W, "inc.item", NULL, NULL);
+  }
+
+  /* Gzip a page for a client that takes it */
+
+#ifdef HAVE_LIBZ
+  {
+     char text[1024];
+     char *body;
+     z_stream zs;
+     size_t clen;
+     setenv("HTTP_ACCEPT_ENCODING", "deflate, gzip", 1);
+     WebTemplate_reset_output(W);
+     WebTemplate_set_compression(W, 9);
+     WebTemplate_set_content_length(W, 1);
+     WebTemplate_set_sink(W, sink, NULL);
+     sink_len = 0;
+     WebTemplate_parse_dynamic(W, "inc.item");
+     WebTemplate_write_template(W, "inc");
+     WebTemplate_assign(W, "GZTAIL", "and a second write.\n");
+     WebTemplate_write(W, "GZTAIL");
+     WebTemplate_finish_output(W);
+     WebTemplate_set_output(W, 1);
+     WebTemplate_set_compression(W, 0);
+     WebTemplate_set_content_length(W, 0);
+     unsetenv("HTTP_ACCEPT_ENCODING");
+     sink_text[sink_len] = '\0';
+     body = strstr(sink_text, "\n\n") + 2;
+     clen = strtoul(strstr(sink_text, "Content-Length: ") + 16, NULL, 10);
+     memset(&zs, '\0', sizeof(zs));
+     inflateInit2(&zs, 31);
+     zs.next_in = (Bytef*) body;
+     zs.avail_in = sink_len - (body-sink_text);
+     zs.next_out = (Bytef*) text;
+     zs.avail_out = sizeof(text)-1;
+     ret = inflate(&zs, Z_FINISH);
+     text[sizeof(text)-1-zs.avail_out] = '\0';
+     body[-1] = '\0';
+     printf("Gzip (%d, one member %d, length %s): %s%s", ret==Z_STREAM_END, zs.avail_in==0,
+        clen==sink_len-(body-sink_text)? "right": "wrong",
+        strstr(sink_text, "Content-Encoding"), text);
+     inflateEnd(&zs);
+
+     /* A client that does not take gzip still gets Vary */
+     WebTemplate_reset_output(W);
+     WebTemplate_set_compression(W, 9);
+     WebTemplate_set_sink(W, sink, NULL);
+     sink_len = 0;
+     WebTemplate_write(W, "GZTAIL");
+     WebTemplate_set_output(W, 1);
+     WebTemplate_set_compression(W, 0);
+     sink_text[sink_len] = '\0';
+     printf("Plain, compression on: %s", sink_text);
+  }
+#endif
+
+  /* Tag a page, and send a 304 to a client that has it */
+
+  {
+     char tag[24];
+     WebTemplate_reset_output(W);
+     WebTemplate_set_etag(W, 1);
+     WebTemplate_set_sink(W, sink, NULL);
+     WebTemplate_assign(W, "TAGGED", "Tagged page.\n");
+     sink_len = 0;
+     WebTemplate_write(W, "TAGGED");
+     sink_text[sink_len] = '\0';
+     printf("ETag: %s", strstr(sink_text, "ETag: ") + 6);
+     sscanf(strstr(sink_text, "ETag: ") + 6, "%23s", tag);
+     setenv("HTTP_IF_NONE_MATCH", tag, 1);
+     WebTemplate_reset_output(W);
+     sink_len = 0;
+     WebTemplate_write(W, "TAGGED");
+     sink_text[sink_len] = '\0';
+     printf("ETag match: %s", sink_text);
+     unsetenv("HTTP_IF_NONE_MATCH");
+     WebTemplate_set_output(W, 1);
+     WebTemplate_set_etag(W, 0);
+  }
+  rf = fopen("include.tpl", "w");
+  fputs("<!-- INCLUDE: nosuch.tpl -->\n", rf);
+  fclose(rf);
+  ret = WebTemplate_get_by_name(W, "inc", "include.tpl");
+  printf("Expected invalid include: (%d), %s\n", ret, WebTemplate_get_error_string(W));
+  fflush(stdout);
+  unlink("include.tpl");
+
+  ret = WebTemplate_load_image(W, "test1.tpl");
+  printf("Expected invalid image: (%d), %s\n", ret, WebTemplate_get_error_string(W));
+  fflush(stdout);
+
+  /* Send a text only page, with request data in an arena */
 
   WebTemplate_reset_output(W);
+  WebTemplate_set_arena(W, 1024);
   WebTemplate_get_by_name(W, "txt", "test4.tpl");
   WebTemplate_assign(W, "TEXT", "Text inserted,\nby program.\n");
   WebTemplate_add_header(W, "Content-type", "text/plain");
+  WebTemplate_set_content_length(W, 1);
   
   WebTemplate_parse(W, "PAGE", "txt");
   WebTemplate_write(W, "PAGE");
+  ret = WebTemplate_write(W, "TEXT");
+  printf("Write past the length: (%d) %s\n", ret, WebTemplate_get_error_string(W));
+  fflush(stdout);
+  WebTemplate_reset(W);
   
   /* for no good reason, free the template */
   WebTemplate_free(W);
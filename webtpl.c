@@ -25,24 +25,50 @@
  */
 
 #ifndef WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <sys/uio.h>
 #define SLEEP sleep(1)
 #else 
 #include <Windows.h>
-#include <ctype.h>
 #include <io.h>
 #define open _open
 #define close _close
+#define read _read
 #define SLEEP Sleep(1000)
+struct iovec { void *iov_base; size_t iov_len; };
+#define localtime_r(t,tm) (localtime_s(tm,t)? NULL: (tm))
 #endif
 
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+/* The part second of a file's modification time, where stat has it,
+   so a file changed in the second it was read is seen to change */
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+#define MTIME_NS(st) ((long)(st)->st_mtim.tv_nsec)
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+#define MTIME_NS(st) ((long)(st)->st_mtimespec.tv_nsec)
+#else
+#define MTIME_NS(st) 0L
+#endif
+
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define LIBRARY
 #include "webtpl.h"
@@ -53,20 +79,145 @@ char *webtpl_version = VERSION;
 char *remote_user = NULL;
 
 
+/* --- memory --- */
+
+/* All library memory comes from these, except strings returned
+   to the caller, which the caller releases with free(). */
+
+static void *(*tpl_malloc)(size_t) = malloc;
+static void *(*tpl_realloc)(void *, size_t) = realloc;
+static void (*tpl_free)(void *) = free;
+
+static char *tpl_strdup(char *s)
+{
+   size_t l = strlen(s) + 1;
+   char *r = (char*) tpl_malloc(l);
+   memcpy(r, s, l);
+   return (r);
+}
+
+/* The request arena */
+
+#define ARENA_ALIGN(n) (((n)+7) & ~(size_t)7)
+#define CHUNK_DATA(c) ((char*)(c) + ARENA_ALIGN(sizeof(TmplChunk_)))
+
+static TmplChunk new_chunk(size_t size)
+{
+   TmplChunk c = (TmplChunk) tpl_malloc(ARENA_ALIGN(sizeof(TmplChunk_)) + size);
+   c->next = NULL;
+   c->size = size;
+   c->used = 0;
+   return (c);
+}
+
+static TmplArena new_arena(size_t chunk)
+{
+   TmplArena A = (TmplArena) tpl_malloc(sizeof(TmplArena_));
+   A->chunk = ARENA_ALIGN(chunk);
+   A->first = new_chunk(A->chunk);
+   A->cur = A->first;
+   A->last = NULL;
+   return (A);
+}
+
+static void *arena_alloc(TmplArena A, size_t len)
+{
+   TmplChunk c = A->cur;
+   TmplChunk n;
+
+   len = ARENA_ALIGN(len);
+   if (c->used+len > c->size) {
+      /* use the next (free) chunk if it is big enough */
+      n = c->next;
+      if (!n || len > n->size) {
+         n = new_chunk(len > A->chunk? len: A->chunk);
+         n->next = c->next;
+         c->next = n;
+      }
+      n->used = 0;
+      A->cur = c = n;
+   }
+   A->last = CHUNK_DATA(c) + c->used;
+   c->used += len;
+   return (A->last);
+}
+
+/* Grow an allocation.  The most recent one can grow in place. */
+
+static void *arena_realloc(TmplArena A, void *p, size_t old, size_t len)
+{
+   TmplChunk c = A->cur;
+   char *n;
+   size_t off;
+
+   if (p && p==A->last) {
+      off = (char*)p - CHUNK_DATA(c);
+      if (off+ARENA_ALIGN(len) <= c->size) {
+         c->used = off + ARENA_ALIGN(len);
+         return (p);
+      }
+   }
+   n = (char*) arena_alloc(A, len);
+   if (p) memcpy(n, p, old);
+   return (n);
+}
+
+/* Release everything in O(1).  The chunks are kept for reuse. */
+
+static void arena_reset(TmplArena A)
+{
+   A->cur = A->first;
+   A->first->used = 0;
+   A->last = NULL;
+}
+
+static void free_arena(TmplArena A)
+{
+   TmplChunk c, n;
+   for (c=A->first;c;c=n) {
+      n = c->next;
+      tpl_free(c);
+   }
+   tpl_free(A);
+}
+
+/* Allocate space for request data: args, cookies, headers,
+   assigned values and dynamic text.  Uses the arena if
+   there is one.  'own' gets the MV_xxx of the space. */
+
+static char *request_alloc(WebTemplate W, size_t len, int *own)
+{
+   if (W->arena) {
+      *own = MV_ARENA;
+      return ((char*) arena_alloc(W->arena, len));
+   }
+   *own = MV_OWN;
+   return ((char*) tpl_malloc(len));
+}
+
+static char *request_strdup(WebTemplate W, char *s, int *own)
+{
+   size_t l = strlen(s) + 1;
+   char *r = request_alloc(W, l, own);
+   memcpy(r, s, l);
+   return (r);
+}
+
+
 /* --- error handlers --- */
 
 static void clear_error_string(WebTemplate W)
 {
-   if (W->error_string) free(W->error_string);
+   if (W->error_string) tpl_free(W->error_string);
    W->error_string = NULL;
 }
 
 static void set_error_string(WebTemplate W, int err, char *msg)
 {
    clear_error_string(W);
-   if (msg) W->error_string = strdup(msg);
+   if (msg) W->error_string = tpl_strdup(msg);
    else {
-      W->error_string = (char*) malloc(512);
+      W->error_string = (char*) tpl_malloc(512);
       strerror_r(err, W->error_string, 512);
       W->error_string[511] = '\0';
    }
@@ -90,9 +241,10 @@ static TmplMacro find_macro(TmplMacro M, char *name)
 
 static TmplMacro malloc_macro(char *name)
 {
-   TmplMacro m = (TmplMacro) malloc(sizeof(TmplMacro_));
+   TmplMacro m = (TmplMacro) tpl_malloc(sizeof(TmplMacro_));
    memset(m,'\0',sizeof(TmplMacro_));
-   m->name = strdup(name);
+   m->name = tpl_strdup(name);
+   m->type = TM_TEXT;
    return (m);
 }
 
@@ -106,7 +258,7 @@ static TmplMacro malloc_macro(char *name)
 static TmplMacro add_macro(TmplMacro M, char *name, char *value)
 {
    TmplMacro m;
-   TmplMacro lm;
+   TmplMacro lm = M;
 
    for (m=M;m;lm=m,m=m->next) if (!strcmp(m->name, name)) break;
    if (!m) {
@@ -114,9 +266,10 @@ static TmplMacro add_macro(TmplMacro M, char *name, char *value)
       lm->next = m;
    } else {
       if (!value) return (m);
-      if (m->value) free(m->value);
+      if (m->value && m->own==MV_OWN) tpl_free(m->value);
    }
    m->value = value;
+   m->own = MV_OWN;
    if (value) m->len = strlen(value);
    else m->len = 0;
    return (m);
@@ -131,7 +284,7 @@ static TmplMacro append_macro_b(TmplMacro M,
                 char *name, char *value, size_t len)
 {
    TmplMacro m;
-   TmplMacro lm;
+   TmplMacro lm = M;
 
    for (m=M;m;lm=m,m=m->next);
    m = malloc_macro(name);
@@ -156,16 +309,196 @@ static void free_macros(TmplMacro M)
    TmplMacro n;
    while (M) {
      n = M->next;
-     if (M->name) free (M->name);
-     if (M->value) free (M->value);
-     if (M->xtra1) free (M->xtra1);
-     if (M->xtra2) free (M->xtra2);
-     free (M);
+     if (M->name) tpl_free (M->name);
+     if (M->value && M->own==MV_OWN) tpl_free (M->value);
+     if (M->xtra1) tpl_free (M->xtra1);
+     if (M->xtra2) tpl_free (M->xtra2);
+     tpl_free (M);
      M = n;
    }
 }
 
 
+/* Indexed macro tables.  The template macros are looked up on
+   every assign, parse and write, so they get a hash index.
+   Macros are never removed from a table, so the index needs
+   no deleted-slot markers. */
+
+#define TABLE_MIN_SLOTS 64
+
+static unsigned int hash_name(char *name)
+{
+   unsigned int h = 2166136261U;  /* FNV-1a */
+   while (*name) h = (h ^ (unsigned char)*name++) * 16777619U;
+   return (h);
+}
+
+static TmplTable new_table()
+{
+   TmplTable M = (TmplTable) tpl_malloc(sizeof(TmplTable_));
+   M->first = NULL;
+   M->last = NULL;
+   M->nslot = TABLE_MIN_SLOTS;
+   M->slot = (TmplMacro*) tpl_malloc(M->nslot*sizeof(TmplMacro));
+   memset(M->slot, 0, M->nslot*sizeof(TmplMacro));
+   M->count = 0;
+   return (M);
+}
+
+/* Double the index when it gets half full */
+
+static void grow_table(TmplTable M)
+{
+   TmplMacro m;
+   size_t i;
+
+   tpl_free(M->slot);
+   M->nslot *= 2;
+   M->slot = (TmplMacro*) tpl_malloc(M->nslot*sizeof(TmplMacro));
+   memset(M->slot, 0, M->nslot*sizeof(TmplMacro));
+   for (m=M->first;m;m=m->next) {
+      for (i=m->hash&(M->nslot-1); M->slot[i]; i=(i+1)&(M->nslot-1));
+      M->slot[i] = m;
+   }
+}
+
+/* Find the index slot for a name.  Returns the slot holding the
+   macro, or the empty slot where it belongs. */
+
+static TmplMacro *table_slot(TmplTable M, char *name, unsigned int h)
+{
+   size_t i;
+   TmplMacro m;
+
+   for (i=h&(M->nslot-1); (m=M->slot[i]); i=(i+1)&(M->nslot-1))
+      if (m->hash==h && !strcmp(m->name, name)) break;
+   return (&M->slot[i]);
+}
+
+static TmplMacro find_indexed_macro(TmplTable M, char *name)
+{
+   return (*table_slot(M, name, hash_name(name)));
+}
+
+/* Replace a macro's value.  'own' says who frees the value. */
+
+static void set_macro_value_b(TmplMacro m, char *value, size_t len, int own)
+{
+   if (m->value && m->own==MV_OWN) tpl_free(m->value);
+   m->value = value;
+   m->len = value? len: 0;
+   m->own = own;
+   m->type = TM_TEXT;
+}
+
+/* Replace a macro's value.  The value must be malloc'd, or null. */
+
+static void set_macro_value(TmplMacro m, char *value)
+{
+   set_macro_value_b(m, value, value? strlen(value): 0, MV_OWN);
+}
+
+/* Typed macros keep a binary value.  It is formatted into the
+   macro's own buffer only when something uses the value. */
+
+static TmplMacro set_macro_type(TmplMacro m, int type)
+{
+   set_macro_value_b(m, NULL, 0, MV_OWN);
+   m->type = type;
+   return (m);
+}
+
+static char digit_pairs[] =
+   "00010203040506070809101112131415161718192021222324"
+   "25262728293031323334353637383940414243444546474849"
+   "50515253545556575859606162636465666768697071727374"
+   "75767778798081828384858687888990919293949596979899";
+
+/* Decimal text of a long, two digits at a time.  Returns the length. */
+
+static int format_long(long v, char *buf)
+{
+   char t[24];
+   char *p = t + sizeof(t);
+   unsigned long u = v<0? -(unsigned long)v: (unsigned long)v;
+   int n;
+
+   while (u >= 100) {
+      n = (int)(u % 100) * 2;
+      u /= 100;
+      *--p = digit_pairs[n+1];
+      *--p = digit_pairs[n];
+   }
+   if (u >= 10) {
+      n = (int)u * 2;
+      *--p = digit_pairs[n+1];
+      *--p = digit_pairs[n];
+   } else *--p = '0' + (char)u;
+   if (v<0) *--p = '-';
+   n = (int)(t + sizeof(t) - p);
+   memcpy(buf, p, n);
+   buf[n] = '\0';
+   return (n);
+}
+
+static void format_macro(TmplMacro m)
+{
+   struct tm tm;
+   int n;
+
+   if (m->value || m->type==TM_TEXT) return;
+   switch (m->type) {
+     case TM_LONG:
+        n = format_long(m->num.l, m->nbuf);
+        break;
+     case TM_DOUBLE:
+        n = snprintf(m->nbuf, sizeof(m->nbuf), "%.*f", m->prec, m->num.d);
+        if (n<0 || n>=(int)sizeof(m->nbuf))
+           n = snprintf(m->nbuf, sizeof(m->nbuf), "%.*g", m->prec, m->num.d);
+        break;
+     case TM_TIME:
+        if (localtime_r(&m->num.t, &tm))
+           n = strftime(m->nbuf, sizeof(m->nbuf), m->fmt, &tm);
+        else n = 0;
+        break;
+     default:
+        return;
+   }
+   if (n<=0) return;
+   m->value = m->nbuf;
+   m->len = n;
+   m->own = MV_REF;
+}
+
+/* Define a macro in a table.  Same rules as add_macro. */
+
+static TmplMacro add_indexed_macro(TmplTable M, char *name, char *value)
+{
+   unsigned int h = hash_name(name);
+   TmplMacro *s = table_slot(M, name, h);
+   TmplMacro m = *s;
+
+   if (!m) {
+      m = malloc_macro(name);
+      m->hash = h;
+      if (M->last) M->last->next = m;
+      else M->first = m;
+      M->last = m;
+      *s = m;
+      if (++M->count*2 > M->nslot) grow_table(M);
+   } else if (!value) return (m);
+   set_macro_value(m, value);
+   return (m);
+}
+
+static void free_table(TmplTable M)
+{
+   free_macros(M->first);
+   tpl_free(M->slot);
+   tpl_free(M);
+}
+
+
 
 /* ---- Templates -----------------*/
 
@@ -176,1060 +509,4064 @@ static void free_macros(TmplMacro M)
             usually read from a file
             identified by parent==NULL
 
-   'dynamic': evaluates into a parents item list;
+   'dynamic': evaluates into its parent's dynamic text;
               always part of a parent template (dynamic block)
               identified by parent!=NULL
 
-   All of the plain templates are linked together from the root.
-   The dynamic templates are linked from a parent item list.
+   A plain template and its blocks form a tree, which is kept in
+   a slot of a template set.  Trees are not changed once they are
+   built, so any number of instances can render the same tree.
+   What an instance renders - its macros, and the dynamic text it
+   has accumulated - is kept in the instance's binding to the slot.
 
  */
 
+/* Reference counts and the set lock */
+
+#ifdef WIN32
+#define ATOMIC_INC(p) InterlockedIncrement((LONG volatile*)(p))
+#define ATOMIC_DEC(p) InterlockedDecrement((LONG volatile*)(p))
+#define LOCK_SET(S) while (InterlockedExchange((LONG volatile*)&(S)->lock,1)) Sleep(0)
+#define UNLOCK_SET(S) InterlockedExchange((LONG volatile*)&(S)->lock,0)
+#else
+#define ATOMIC_INC(p) __sync_add_and_fetch((p),1)
+#define ATOMIC_DEC(p) __sync_sub_and_fetch((p),1)
+#define LOCK_SET(S) while (__sync_lock_test_and_set(&(S)->lock,1)) sched_yield()
+#define UNLOCK_SET(S) __sync_lock_release(&(S)->lock)
+#endif
+
 
 /* Allocate a template structure */
 
-static Template new_template(WebTemplate W, char *name, TmplItem pip)
+static Template new_template(char *name, Template parent)
 {
-   Template N = (Template) malloc(sizeof(Template_));
-   Template t;
-   N->next = NULL;
-   N->pip = pip;
-   N->base = (void*) W;
-   if (!pip) {   /* if plain link to root */
-      if (t=W->template) {
-         while (t->next) t = t->next;
-         t->next = N;
-      } else W->template = N;
-   }
-   N->name = strdup(name);
+   Template N = (Template) tpl_malloc(sizeof(Template_));
+   N->parent = parent;
+   N->name = tpl_strdup(name);
+   N->index = 0;
    N->item = NULL;
-   N->last = NULL;
+   N->nitem = 0;
+   N->aitem = 0;
+   N->slen = 0;
+   N->var = NULL;
+   N->nvar = 0;
+   N->used = NULL;
+   N->nused = 0;
+   N->text = NULL;
+   N->ztext = NULL;
    return (N);
 }
 
-/* Find a template by name */
+/* Append a new item to a template.  The item pointer is good
+   until the next item is added. */
 
-/* find the 'plain' part */
-static Template find_plain_template(WebTemplate W, char *name)
+static TmplItem add_item(Template t, int type, void *content, size_t len)
 {
-   Template t;
-   for (t=W->template;t;t=t->next) if (!strcmp(t->name, name)) return (t);
-   return (NULL);
+   TmplItem n;
+   if (t->nitem==t->aitem) {
+      t->aitem = t->aitem? 2*t->aitem: 16;
+      t->item = (TmplItem) tpl_realloc(t->item, t->aitem*sizeof(TmplItem_));
+   }
+   n = t->item + t->nitem++;
+   n->type = type;
+   n->content = content;
+   n->len = len;
+   n->index = 0;
+   n->filter = TF_NONE;
+   return (n);
 }
 
-/* find the dynamic part */
-static Template find_dynamic_template(Template B, char *name)
+static int cmp_int(const void *a, const void *b)
+{
+   return (*(const int*)a - *(const int*)b);
+}
+
+/* Finish a template that has been read.  Adjacent text items are
+   merged: in place if they lie together in the source, else copied.
+   The static length, the variable items and the macros they use
+   are noted. */
+
+static void finish_template(Template T)
+{
+   TmplItem ti, l;
+   size_t ncopy = 0;
+   char *c = NULL;
+   int copied = -1;
+   int i, n;
+
+   for (i=1; i<T->nitem; i++) {
+      if (T->item[i].type==TI_TEXT && T->item[i-1].type==TI_TEXT)
+         ncopy += T->item[i-1].len + T->item[i].len;
+   }
+   for (i=0,n=0; i<T->nitem; i++) {
+      ti = T->item + i;
+      l = n? T->item + n-1: NULL;
+      if (ti->type==TI_TEXT && l && l->type==TI_TEXT) {
+         if ((char*)l->content + l->len != (char*)ti->content) {
+            if (!T->text) c = T->text = (char*) tpl_malloc(ncopy);
+            if (copied!=n-1) {
+               memcpy(c, l->content, l->len);
+               l->content = c;
+               c += l->len;
+               copied = n-1;
+            }
+            memcpy(c, ti->content, ti->len);
+            c += ti->len;
+         }
+         l->len += ti->len;
+         continue;
+      }
+      T->item[n++] = *ti;
+   }
+   T->nitem = n;
+   if (n) T->item = (TmplItem) tpl_realloc(T->item, n*sizeof(TmplItem_));
+   T->aitem = n;
+
+   for (i=0; i<n; i++) if (T->item[i].type!=TI_TEXT) T->nvar++;
+   T->var = (int*) tpl_malloc((T->nvar+1)*sizeof(int));
+   for (i=0,n=0; i<T->nitem; i++) {
+      ti = T->item + i;
+      if (ti->type==TI_TEXT) T->slen += ti->len;
+      else T->var[n++] = i;
+      if (ti->type==TI_DYNAMIC) finish_template((Template)ti->content);
+   }
+
+   T->used = (int*) tpl_malloc((T->nvar+1)*sizeof(int));
+   for (i=0,n=0; i<T->nvar; i++) {
+      ti = T->item + T->var[i];
+      if (ti->type==TI_MACRO) T->used[n++] = ti->index;
+   }
+   qsort(T->used, n, sizeof(int), cmp_int);
+   for (i=0; i<n; i++) {
+      if (!T->nused || T->used[T->nused-1]!=T->used[i]) T->used[T->nused++] = T->used[i];
+   }
+}
+
+/* Free a template and its blocks. */
+
+static void free_templates(Template T)
+{
+  int i;
+  
+  if (!T) return;
+  for (i=0; i<T->nitem; i++) {
+    if (T->item[i].type==TI_DYNAMIC) free_templates((Template)T->item[i].content);
+  }
+  if (T->item) tpl_free(T->item);
+  if (T->var) tpl_free(T->var);
+  if (T->used) tpl_free(T->used);
+  if (T->text) tpl_free(T->text);
+  if (T->ztext) {
+    for (i=0; i<T->nitem; i++) {
+      if (T->ztext[i].data) tpl_free(T->ztext[i].data);
+    }
+    tpl_free(T->ztext);
+  }
+  if (T->name) tpl_free(T->name);
+  tpl_free (T);
+}
+
+/* find a dynamic block of a template */
+
+static Template find_dynamic_template(Template B, char *name, size_t len)
 {
-   TmplItem i;
    Template t;
-   for (i=B->item;i;i=i->next) {
+   int v;
+   for (v=0; v<B->nvar; v++) {
+       TmplItem i = B->item + B->var[v];
        if (i->type!=TI_DYNAMIC) continue;
        t = (Template) i->content;
-       if (!strcmp(t->name, name)) return (t);
+       if (strlen(t->name)==len && !strncmp(t->name, name, len)) return (t);
    }
    return (NULL);
 }
 
-/* name is: "base.dyn.dyn..." */
-static Template find_template(WebTemplate W, char *name)
-{
-   Template bt;
-   char *base = strdup(name);
-   char *d = strchr(base,'.');
-   if (d) {   /* dynamic block name */
-      *d++ = '\0';
-      bt = find_plain_template(W, base);
-      /* find dynamic part */
-      while (bt && d) {
-         char *dn = strchr(d,'.');
-         if (dn) *dn++ = '\0';
-         bt = find_dynamic_template(bt, d);
-         d = dn;
-      }
-   } else bt = find_plain_template(W,base);
-   free(base);
-   return (bt);
+/* Template images are shared by the trees made from them */
+
+static void release_image(TmplImage I)
+{
+   if (!I || ATOMIC_DEC(&I->refs)) return;
+#ifndef WIN32
+   if (I->mapped) munmap(I->base, I->size);
+   else
+#endif
+   tpl_free(I->base);
+   tpl_free(I);
 }
-         
 
-/* Allocate and append a new item to a template */
+/* Trees */
 
-static TmplItem add_item(Template t, int type, void *content, size_t len)
+static TmplTree new_tree(char *name)
 {
-   TmplItem n = (TmplItem) malloc(sizeof(TmplItem_));
-   TmplItem te;
-   n->next = NULL;
-   n->parent = t;
-   n->type = type;
-   n->content = content;
-   n->len = len;
-
-   /* link this item to the end */
-   te = t->last;
-   if (te) {
-      te->next = n;
-      t->last = n;
-   } else {
-      t->item = n;
-      t->last = n;
-   }
-   return (n);
+   TmplTree t = (TmplTree) tpl_malloc(sizeof(TmplTree_));
+   t->refs = 1;
+   t->root = new_template(name, NULL);
+   t->macros = new_table();
+   t->mac = NULL;
+   t->nmacro = 0;
+   t->ndyn = 0;
+   t->src = NULL;
+   t->image = NULL;
+   t->inc = NULL;
+   t->ninc = 0;
+   t->path = NULL;
+   t->cstart = NULL;
+   t->cend = NULL;
+   t->mtime = 0;
+   t->mtime_ns = 0;
+   t->size = 0;
+   t->ino = 0;
+   return (t);
 }
 
-/* Allocate and insert a new item into a template's item list
-   Insert after 'tgt'. */
+/* Add a macro used by a tree.  Returns the macro. */
 
-static TmplItem insert_item(TmplItem tgt, int type, void *content)
+static TmplMacro tree_macro(TmplTree t, char *name)
 {
-   TmplItem n;
-   Template P;
-
-   /* If we're appending a dtext to a dtext just append the content.
-      This keeps the number of items smaller. */
-   if (type==TI_DTEXT && tgt->type==TI_DTEXT) {
-      int nlen = strlen(content);
-      tgt->content = (char*) realloc(tgt->content, tgt->len + nlen + 1);
-      strcpy(tgt->content+tgt->len, content);
-      tgt->len += nlen;
-      free(content);
-      return (tgt);
-   }
-   n = (TmplItem) malloc(sizeof(TmplItem_));
-   P = (Template) tgt->parent;
-   n->next = tgt->next;
-   tgt->next = n;
-   n->parent = P;
-   if (P->last == tgt) P->last = n;
-   n->type = type;
-   n->content = content;
-   n->len = strlen(content);
-   return (n);
+   size_t n = t->macros->count;
+   TmplMacro m = add_indexed_macro(t->macros, name, NULL);
+   if (t->macros->count > n) m->index = t->nmacro++;
+   return (m);
 }
-   
 
-/* Free a string of templates, starting with the specified template. */
+/* Add a dynamic block to a tree */
 
-static void free_templates(Template T)
+static Template tree_block(TmplTree t, Template T, char *name)
 {
-  Template n;
-  TmplItem i,j;
-  
-  while (T) {
-     n = T->next;
-     i = T->item;
-     while (i) {
-       j = i->next;
-       if (i->content) {
-         if (i->type==TI_TEXT || i->type==TI_DTEXT) free(i->content);
-         else if (i->type==TI_DYNAMIC) free_templates((Template)i->content);
-       }
-       free(i);
-       i = j;
-     }
-
+   Template D = new_template(name, T);
+   D->index = t->ndyn++;
+   add_item(T, TI_DYNAMIC, D, 0)->index = D->index;
+   return (D);
+}
 
-/***
-if (T->pip) {
-  printf("freeT name = %s, pip=%x\n", T->name, T->pip);
-  printf("pip   content = %s\n", T->pip->content);
+/* Index the macros of a finished tree */
 
-  free(T->pip);
-} else {
-  printf("freeT name = %s, pip=NULL\n", T->name);
+static void finish_tree(TmplTree t)
+{
+   TmplMacro m;
+   t->mac = (TmplMacro*) tpl_malloc((t->nmacro+1)*sizeof(TmplMacro));
+   for (m=t->macros->first;m;m=m->next) t->mac[m->index] = m;
+   finish_template(t->root);
 }
-**/
-     if (T->name) free(T->name);
-     free (T);
-     T = n;
-  }
-  return;
+
+static void release_tree(TmplTree t)
+{
+   int i;
+   if (!t || ATOMIC_DEC(&t->refs)) return;
+   for (i=0; i<t->ninc; i++) release_tree(t->inc[i]);
+   if (t->inc) tpl_free(t->inc);
+   if (t->path) tpl_free(t->path);
+   if (t->cstart) tpl_free(t->cstart);
+   if (t->cend) tpl_free(t->cend);
+   free_templates(t->root);
+   free_table(t->macros);
+   if (t->mac) tpl_free(t->mac);
+   if (t->src) tpl_free(t->src);
+   release_image(t->image);
+   tpl_free(t);
 }
 
-/* Free a single template.  Called because of failure during
-   the reading of a template form file, or because a template
-   name was reused. */
+/* Sets */
 
-static void free_template(WebTemplate W, Template T)
+static TmplSet new_set()
 {
-   Template nt = T->next;
-   Template t = NULL;
-   
-   /* Free all the content of this template only */
-   T->next = NULL;
-   free_templates(T);
+   TmplSet S = (TmplSet) tpl_malloc(sizeof(TmplSet_));
+   S->refs = 1;
+   S->lock = 0;
+   S->slot = NULL;
+   S->nslot = 0;
+   S->reload = 0;
+   S->inc = NULL;
+   S->ninc = 0;
+   S->precompress = 0;
+   return (S);
+}
 
-   if (T==W->template) W->template = nt;
-   else for (t=W->template;t;t=t->next) if (T==t->next) break;
-   if (t) t->next = nt;
+static void free_source(char *path, char *cstart, char *cend)
+{
+   if (path) tpl_free(path);
+   if (cstart) tpl_free(cstart);
+   if (cend) tpl_free(cend);
 }
-   
-/* -------- Template readers ------------- */
 
-  
-static char *read_dyn_name(char *in)
+static void release_set(TmplSet S)
 {
-  char *n = strchr(in,':');
+   int s;
+   if (ATOMIC_DEC(&S->refs)) return;
+   for (s=0; s<S->nslot; s++) {
+      release_tree(S->slot[s]->tree);
+      free_source(S->slot[s]->path, S->slot[s]->cstart, S->slot[s]->cend);
+      tpl_free(S->slot[s]->name);
+      tpl_free(S->slot[s]);
+   }
+   if (S->slot) tpl_free(S->slot);
+   for (s=0; s<S->ninc; s++) release_tree(S->inc[s]);
+   if (S->inc) tpl_free(S->inc);
+   tpl_free(S);
+}
 
-  if (!n++) return (NULL);
-  while (isspace(*n)) n++;
-  in = n;
-  while (*in && (isalnum(*in)||(*in=='_'))) in++;
-  *in = '\0';
-  return (n);
+/* Find a slot by name.  The caller holds the lock. 
+   Returns the slot number, or -1. */
+
+static int find_slot(TmplSet S, char *name, size_t len)
+{
+   int s;
+   for (s=0; s<S->nslot; s++) {
+      char *n = S->slot[s]->name;
+      if (!strncmp(n, name, len) && !n[len]) return (s);
+   }
+   return (-1);
 }
 
-/* process a line of the template file */
+/* Put a new tree in a named slot.  The set takes the caller's
+   reference.  Instances still using the old tree keep it until
+   they are done with it.  'path' and 'st' describe the source file,
+   if the template can be reloaded.  Returns the slot number. */
 
-static Template read_line(Template T, char *line)
+static int set_tree(WebTemplate W, char *name, TmplTree t,
+                    char *path, struct stat *st)
 {
-   char *m, *e;
-   WebTemplate W = (WebTemplate) T->base;
-   
-   /* If in comments, look for end */
-   if (W->cip) {
-      if (!strncmp(line,W->cend,W->lcend)) W->cip = 0;
-      return (T);
+   TmplSet S = W->set;
+   TmplSlot sl;
+   TmplTree old;
+   char *opath, *ocstart, *ocend;
+   char *npath = NULL;
+   char *ncstart = NULL;
+   char *ncend = NULL;
+   int s;
+
+   if (path) {
+      npath = tpl_strdup(path);
+      if (W->cstart) ncstart = tpl_strdup(W->cstart);
+      if (W->cend) ncend = tpl_strdup(W->cend);
    }
-   /* Look for comment line */
-   if (W->cstart && !strncmp(line,W->cstart,W->lcstart)) {
-      if (W->cend) W->cip = 1;
-      return (T);
+
+   LOCK_SET(S);
+   if ((s=find_slot(S, name, strlen(name)))<0) {
+      sl = (TmplSlot) tpl_malloc(sizeof(TmplSlot_));
+      memset(sl, '\0', sizeof(TmplSlot_));
+      sl->name = tpl_strdup(name);
+      S->slot = (TmplSlot*) tpl_realloc(S->slot, (S->nslot+1)*sizeof(TmplSlot));
+      s = S->nslot++;
+      S->slot[s] = sl;
+   }
+   sl = S->slot[s];
+   old = sl->tree;
+   sl->tree = t;
+   opath = sl->path;
+   ocstart = sl->cstart;
+   ocend = sl->cend;
+   sl->path = npath;
+   sl->cstart = ncstart;
+   sl->cend = ncend;
+   if (path) {
+      sl->mtime = st->st_mtime;
+      sl->mtime_ns = MTIME_NS(st);
+      sl->size = st->st_size;
+      sl->ino = st->st_ino;
+      sl->checked = time(NULL);
    }
+   UNLOCK_SET(S);
 
-   /* look for dynamic block start */
-   for (m=line;*m&&*m==' ';m++);
-   if ((!strncmp(m,"<!-- BEGIN DYNAMIC BLOCK:",25)) ||
-       (!strncmp(m,"<!-- BDB:",9))) {
-      char *dn = read_dyn_name(m);
-      Template D;
-      if (!T->last) add_item(T, TI_TEXT, NULL, 0); /* dyn needs insert point */ 
-      D = new_template(W, dn, T->last);
-      add_item(T, TI_DYNAMIC, D, 0);
-      return (D);
+   release_tree(old);
+   free_source(opath, ocstart, ocend);
+   return (s);
+}
 
-   /* look for dynamic block end */
-   } else if ((!strncmp(m,"<!-- END DYNAMIC BLOCK:",23)) ||
-              (!strncmp(m,"<!-- EDB:",9))) {
-      char *dn = read_dyn_name(m);
-      if (strcmp(T->name, dn)) {
-         char emsg[512];
-         snprintf(emsg, 512, "Block %s ended with %s\n", T->name, dn);
-         set_error_string(W, -1, emsg);
-         return (NULL);
-      }
-      return (T->pip->parent);
-     
-   /* copy text and macros */
-   } else {
-      char *tm = line;
-      while (m = strchr(tm,'{')) {
-         char *v;
-         for (v=0,e=m+1;*e && (isalnum(*e)||(*e=='_')); e++);
-         if (*e == '=') {   /* have value assignment */
-            char *b;
-            /* value */
-            *e++ = '\0';
-            v = e;
-            b = strchr(e, '}');
-            if (b) e = b;
-         }
-         if (*e == '}') {
-            /* macro item */
-            *m++ = '\0';
-            *e++ = '\0';
-            add_item(T, TI_TEXT, (void*) strdup(line), strlen(line));
-            if (v) v = strdup(v);
-            add_item(T, TI_MACRO, (void*) add_macro(W->macros, m, v), 0);
-            line = e;
-            tm = e;
-            continue;
-         } 
-         tm = e+1;
-         continue;
+/* Bindings */
+
+static void clear_bind_dynamic(TmplBind B, int ndyn)
+{
+   int d;
+   for (d=0; d<ndyn; d++) {
+      B->dyn[d].len = 0;
+      if (B->dyn[d].own==MV_ARENA) {
+         B->dyn[d].text = NULL;
+         B->dyn[d].size = 0;
+         B->dyn[d].own = MV_OWN;
       }
-      add_item(T, TI_TEXT, (void*) strdup(line), strlen(line));
    }
-   return (T);
 }
 
-/* Parse a template file
-   Return 0 on success, else errno or -1 */
+static void unbind(TmplBind B)
+{
+   int d;
+   if (!B->tree) return;
+   for (d=0; d<B->tree->ndyn; d++) {
+      if (B->dyn[d].text && B->dyn[d].own==MV_OWN) tpl_free(B->dyn[d].text);
+   }
+   tpl_free(B->dyn);
+   tpl_free(B->mac);
+   release_tree(B->tree);
+   B->tree = NULL;
+}
+
+/* Is any dynamic text waiting */
 
-static int read_template_file(Template T, FILE *f)
+static int bind_pending(TmplBind B)
 {
-   char line[8192];
+   int d;
+   for (d=0; d<B->tree->ndyn; d++) if (B->dyn[d].len) return (1);
+   return (0);
+}
 
-   errno = 0;
-   while (T && fgets(line, 8192, f)) T = read_line(T, line);
+/* Deferred parses.  They are rendered in the evaluation section. */
 
-   if (!T) return (-1);
+static void changing(WebTemplate W, TmplMacro m);
 
-   if (errno && errno!=EBADF && errno!=EINVAL) {
-      set_error_string((WebTemplate)T->base, errno, NULL);
-      return (errno);
-   }
-   
-   if (T->pip) {
-      char emsg[512];
-      snprintf(emsg, 512, "Block %s did not end", T->name);
-      set_error_string((WebTemplate)T->base, -1, emsg);
-      return (-1);
-   }
+/* Does a template use a macro, other than in its blocks */
 
-   if (((WebTemplate)T->base)->cip) {
-      char emsg[512];
-      snprintf(emsg, 512, "Comment in %s did not end", T->name);
-      set_error_string((WebTemplate)T->base, -1, emsg);
-      return (-1);
+static int template_uses(TmplBind B, Template T, TmplMacro m)
+{
+   TmplItem ti;
+   int v;
+
+   for (v=0; v<T->nvar; v++) {
+      ti = T->item + T->var[v];
+      if (ti->type==TI_MACRO && B->mac[ti->index]==m) return (1);
    }
    return (0);
 }
 
-/* ------ API template calls -------- */
+/* Drop a deferred parse.  Its macro is left with no value.
+   Old values it was keeping are freed with their last user. */
 
-/* Create a web template */
-WebTemplate WebTemplate_new()
+static void free_defer(WebTemplate W, TmplDefer P)
 {
-   WebTemplate W = (WebTemplate) malloc(sizeof(WebTemplate_));
-   W->template = NULL;
-   W->macros = malloc_macro("-");
-   W->arg = malloc_macro("-");
-   W->in_cookie = malloc_macro("-");
-   W->header = malloc_macro("-");
-   W->octet = malloc_macro("-");
-   W->header_sent = 0;
-   W->fd = 1;
-   W->cstart = NULL;
-   W->cend = NULL;
-   W->cip = 0;
-   W->error_string = NULL;
-   return (W);
+   TmplDefer *pp;
+   TmplMacro m;
+   int i;
+
+   for (pp=&W->defer; *pp!=P; pp=&(*pp)->next);
+   *pp = P->next;
+   P->m->type = TM_TEXT;
+   P->m->defer = NULL;
+   for (i=0; i<P->bind.tree->nmacro; i++) {
+      m = P->bind.mac[i];
+      if (!m->refs || --m->refs) continue;
+      if (m->type==TM_TMPL) free_defer(W, m->defer);
+      m->next = NULL;
+      free_macros(m);
+   }
+   unbind(&P->bind);
+   tpl_free(P);
 }
-WebTemplate newWebTemplate()
+
+/* Move a macro's value to a new macro, for the deferred parses
+   that use it.  The macro is left with no value. */
+
+static TmplMacro retire_macro(TmplMacro m)
 {
-   return (WebTemplate_new());
+   TmplMacro r = malloc_macro(m->name);
+
+   format_macro(m);   /* a time's format is the caller's */
+   r->value = m->value==m->nbuf? r->nbuf: m->value;
+   r->len = m->len;
+   r->own = m->own;
+   r->type = m->type;
+   r->num = m->num;
+   r->prec = m->prec;
+   r->fmt = m->fmt;
+   memcpy(r->nbuf, m->nbuf, sizeof(r->nbuf));
+   if ((r->defer = m->defer)) r->defer->m = r;
+   m->value = NULL;
+   m->len = 0;
+   m->own = MV_OWN;
+   m->type = TM_TEXT;
+   m->defer = NULL;
+   return (r);
 }
 
-void WebTemplate_free(WebTemplate W)
+/* Bind an instance to a slot's current tree.  An instance keeps its
+   old tree while it has dynamic text for it, unless 'force'.
+   Template default values replace macro values only if 'force'. */
+
+static TmplBind bind_slot(WebTemplate W, int s, int force)
 {
-   if (W) {
-     free_templates(W->template);
-     free_macros(W->macros);
-     free_macros(W->arg);
-     free_macros(W->in_cookie);
-     free_macros(W->header);
-     free_macros(W->octet);
-     if (W->error_string) free(W->error_string);
-     if (W->cstart) free(W->cstart);
-     if (W->cend) free(W->cend);
-     free(W);
+   TmplBind B;
+   TmplTree t;
+   int i;
+
+   if (s>=W->nbind) {
+      W->bind = (TmplBind) tpl_realloc(W->bind, (s+1)*sizeof(TmplBind_));
+      memset(W->bind+W->nbind, '\0', (s+1-W->nbind)*sizeof(TmplBind_));
+      W->nbind = s+1;
+   }
+   B = W->bind + s;
+
+   LOCK_SET(W->set);
+   t = W->set->slot[s]->tree;
+   if (t==B->tree || (B->tree && !force && bind_pending(B))) {
+      UNLOCK_SET(W->set);
+      return (B);
+   }
+   ATOMIC_INC(&t->refs);
+   UNLOCK_SET(W->set);
+
+   unbind(B);
+   B->tree = t;
+   B->mac = (TmplMacro*) tpl_malloc((t->nmacro+1)*sizeof(TmplMacro));
+   for (i=0; i<t->nmacro; i++) {
+      TmplMacro m = add_indexed_macro(W->macros, t->mac[i]->name, NULL);
+      if (t->mac[i]->value && (force || (m->type==TM_TEXT && !m->value))) {
+         if (W->defer) changing(W, m);
+         set_macro_value(m, tpl_strdup(t->mac[i]->value));
+      }
+      B->mac[i] = m;
    }
+   B->dyn = (TmplDyn) tpl_malloc((t->ndyn+1)*sizeof(TmplDyn_));
+   memset(B->dyn, '\0', (t->ndyn+1)*sizeof(TmplDyn_));
+   return (B);
 }
-void freeWebTemplate(WebTemplate W)
+
+#ifdef HAVE_LIBZ
+
+/* zlib allocates with the library's memory functions */
+
+static voidpf gz_alloc(voidpf opaque, uInt n, uInt size)
 {
-   WebTemplate_free(W);
+   (void)opaque;
+   return (tpl_malloc((size_t)n*size));
 }
 
-/* set the output fd - default is stdout */
-void WebTemplate_set_output(WebTemplate W, int fd)
+static void gz_free(voidpf opaque, voidpf p)
 {
-   clear_error_string(W);
-   W->fd = fd;
+   (void)opaque;
+   tpl_free(p);
 }
 
-/* set for no headers - e.g. output to html file */
-void WebTemplate_set_noheader(WebTemplate W)
+/* Gzip a template's text items once, each on its own, at the best
+   level.  Short items are left to be compressed with the page. */
+
+static void precompress_template(Template T)
 {
-   clear_error_string(W);
-   W->header_sent = 1;
+   z_stream zs;
+   TmplItem ti;
+   TmplZText z;
+   size_t size;
+   int i;
+
+   memset(&zs, '\0', sizeof(zs));
+   zs.zalloc = gz_alloc;
+   zs.zfree = gz_free;
+   if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8,
+                    Z_DEFAULT_STRATEGY)!=Z_OK) return;
+   T->ztext = (TmplZText) tpl_malloc((T->nitem+1)*sizeof(TmplZText_));
+   memset(T->ztext, '\0', (T->nitem+1)*sizeof(TmplZText_));
+   for (i=0; i<T->nitem; i++) {
+      ti = T->item + i;
+      if (ti->type==TI_DYNAMIC) precompress_template((Template)ti->content);
+      if (ti->type!=TI_TEXT || ti->len<TPL_ZTEXT_MIN) continue;
+      z = T->ztext + i;
+      deflateReset(&zs);
+      size = deflateBound(&zs, ti->len) + 16;   /* and the sync flush */
+      z->data = (char*) tpl_malloc(size);
+      zs.next_in = (Bytef*) ti->content;
+      zs.avail_in = ti->len;
+      zs.next_out = (Bytef*) z->data;
+      zs.avail_out = size;
+      if (deflate(&zs, Z_SYNC_FLUSH)!=Z_OK || zs.avail_in || !zs.avail_out) {
+         tpl_free(z->data);
+         z->data = NULL;
+         continue;
+      }
+      z->len = size - zs.avail_out;
+      z->data = (char*) tpl_realloc(z->data, z->len);
+      z->crc = crc32(0, (Bytef*) ti->content, ti->len);
+   }
+   deflateEnd(&zs);
 }
+#endif
 
-/* set comment designators  */
-void WebTemplate_set_comments(WebTemplate W, char *start, char *end)
+/* Install a new tree, and bind to it, replacing macro values
+   with its defaults, as a fresh load always has. */
+
+static void install_tree(WebTemplate W, char *name, TmplTree t,
+                         char *path, struct stat *st)
 {
-   clear_error_string(W);
-   if (W->cstart) free(W->cstart);
-   if (W->cend) free(W->cend);
+   finish_tree(t);
+#ifdef HAVE_LIBZ
+   if (W->set->precompress) precompress_template(t->root);
+#endif
+   bind_slot(W, set_tree(W, name, t, path, st), 1);
+}
 
-   if (start && *start) {
-      W->cstart = strdup(start);
-      W->lcstart = strlen(start);
-      if (end && *end) {
-         W->cend = strdup(end);
-         W->lcend = strlen(end);
-      } else W->cend = NULL;
-   } else W->cstart = NULL;
+/* Drop any dynamic content that has not been parsed into its parent. */
+
+static void clear_dynamic(WebTemplate W)
+{
+   int s;
+   for (s=0; s<W->nbind; s++) {
+      if (W->bind[s].tree) clear_bind_dynamic(W->bind+s, W->bind[s].tree->ndyn);
+   }
 }
+   
+/* -------- Template readers ------------- */
 
+/* Included files may nest this deep, which stops include loops */
+#define TPL_MAX_INCLUDE 16
 
-/* Assign a value to a macro.
-   Null value clears the macro. */
 
-void WebTemplate_assign(WebTemplate W, char *name, char *value)
+/* Find the name of a dynamic block.  'le' is the end of the line. */
+
+static char *read_dyn_name(char *in, char *le)
 {
-   TmplMacro m;
-   clear_error_string(W);
-   if (name) {
-      if (value && *value) add_macro(W->macros,name,strdup(value));
-      else if ((m=find_macro(W->macros, name)) && m->value) {
-         free(m->value);
-         m->value = NULL;
-         m->len = 0;
-      }
-   }
+  char *n = memchr(in, ':', le-in);
+
+  if (!n++) return (NULL);
+  while (n<le && isspace(*n)) n++;
+  in = n;
+  while (in<le && (isalnum(*in)||(*in=='_'))) in++;
+  *in = '\0';
+  return (n);
 }
 
+/* Find the file named by an include line, relative to the
+   directory of the file including it.  The name ends at a space
+   or at the "-->" that closes the comment.  Returns a new string. */
 
-/* Assign an integer value to a macro. */
+static char *read_include_path(char *in, char *le, char *from)
+{
+  char *n = memchr(in, ':', le-in);
+  char *e, *p;
+  size_t d = 0;
 
-void WebTemplate_assign_int(WebTemplate W, char *name, int value)
+  if (!n++) return (NULL);
+  while (n<le && isspace(*n)) n++;
+  for (e=n; e<le && !isspace(*e) && !(le-e>=3 && !memcmp(e, "-->", 3)); e++);
+  if (e==n) return (NULL);
+  if (*n!='/' && from && (p=strrchr(from, '/'))) d = p+1-from;
+  p = (char*) tpl_malloc(d+(e-n)+1);
+  if (d) memcpy(p, from, d);
+  memcpy(p+d, n, e-n);
+  p[d+(e-n)] = '\0';
+  return (p);
+}
+
+/* Filters escape a macro's value as it is substituted */
+
+static char *filter_names[] = { "", "html", "url", "js", NULL };
+
+static int find_filter(char *name, size_t len)
 {
-   char v[16];
-   clear_error_string(W);
-   if (name) {
-      sprintf(v, "%d", value);
-      add_macro(W->macros,name,strdup(v));
-   }
+   int f;
+   for (f=1; filter_names[f]; f++)
+      if (strlen(filter_names[f])==len && !strncmp(filter_names[f], name, len))
+         return (f);
+   return (TF_NONE);
 }
 
+/* Does the line start with 's' */
+#define LINE_IS(l,le,s,n) ((size_t)((le)-(l))>=(size_t)(n) && !memcmp((l),(s),(n)))
 
-/* Load a template from an open socket */
-int WebTemplate_get_by_fd(WebTemplate W, char *name, int fd)
+/* Add text from the template source.  The item points into the source. */
+
+static void add_text(Template T, char *text, size_t len)
 {
-   Template T;
-   int ret;
-   clear_error_string(W);
-   FILE *f = fdopen(fd, "r");
-   if (!f) return (errno);
-   if (T=find_plain_template(W, name)) free_template(W, T);
-   T = new_template(W, name, NULL);
-   ret = read_template_file(T, f);
-   fclose(f);
-   if (ret==0) return (0);
-   free_template(W, T);
-   return(errno);
+   if (len) add_item(T, TI_TEXT, (void*) text, len);
 }
 
-/* Load a template from an open file */
-int WebTemplate_get_by_fp(WebTemplate W, char *name, FILE *f)
+/* Find the next '{' or 'c', 32 or 16 bytes at a time where the
+   compiler offers AVX2 or SSE2.  Returns 'end' if there is neither. */
+
+static char *scan_text(char *p, char *end, char c)
 {
-   Template T;
-   int ret;
-   clear_error_string(W);
-   if (!f) return (errno);
-   if (T=find_plain_template(W, name)) free_template(W, T);
-   T = new_template(W, name, NULL);
-   if ((ret=read_template_file(T, f))==0) return (ret);
-   free_template(W, T);
-   return(errno);
+#if defined(__GNUC__) && defined(__AVX2__)
+   __m256i lb = _mm256_set1_epi8('{');
+   __m256i nl = _mm256_set1_epi8(c);
+   while (end-p >= 32) {
+      __m256i v = _mm256_loadu_si256((__m256i*) p);
+      unsigned int k = _mm256_movemask_epi8(_mm256_or_si256(
+                          _mm256_cmpeq_epi8(v, lb), _mm256_cmpeq_epi8(v, nl)));
+      if (k) return (p + __builtin_ctz(k));
+      p += 32;
+   }
+#elif defined(__GNUC__) && defined(__SSE2__)
+   __m128i lb = _mm_set1_epi8('{');
+   __m128i nl = _mm_set1_epi8(c);
+   while (end-p >= 16) {
+      __m128i v = _mm_loadu_si128((__m128i*) p);
+      unsigned int k = _mm_movemask_epi8(_mm_or_si128(
+                          _mm_cmpeq_epi8(v, lb), _mm_cmpeq_epi8(v, nl)));
+      if (k) return (p + __builtin_ctz(k));
+      p += 16;
+   }
+#endif
+   while (p<end && *p!='{' && *p!=c) p++;
+   return (p);
 }
 
-/* Load a template from a file */
-int WebTemplate_get_by_name(WebTemplate W, char *name, char *filename)
+/* Included files are read as templates of their own, below */
+
+static TmplTree load_include(WebTemplate W, char *path);
+
+/* Splice an included template's items into T.  Its macros and
+   blocks become the tree's own.  Its default values fill in only
+   those the tree does not have. */
+
+static void splice_template(TmplTree t, Template T, TmplTree it, Template I)
 {
-   int s;
-   int fd;
-   clear_error_string(W);
-   fd = open(filename,O_RDONLY,0);
-   if (fd<0) {
-      set_error_string(W, errno, NULL);
-      return(errno);
+   TmplItem ti, n;
+   TmplMacro m, tm;
+   int i;
+
+   for (i=0; i<I->nitem; i++) {
+      ti = I->item + i;
+      if (ti->type==TI_TEXT) add_text(T, (char*) ti->content, ti->len);
+      else if (ti->type==TI_MACRO) {
+         m = it->mac[ti->index];
+         tm = tree_macro(t, m->name);
+         if (m->value && !tm->value) set_macro_value(tm, tpl_strdup(m->value));
+         n = add_item(T, TI_MACRO, NULL, 0);
+         n->index = tm->index;
+         n->filter = ti->filter;
+      } else {
+         Template D = (Template) ti->content;
+         splice_template(t, tree_block(t, T, D->name), it, D);
+      }
    }
-   s = WebTemplate_get_by_fd(W, name, fd);
-   close(fd);
-   return (s);
 }
 
+/* Read a comment, block or include directive line.  The line runs
+   from 'line' up to 'le' and includes its newline.  'path' is the
+   file being read, if known.  Returns 1 if the line was one, 0 if
+   it is template text.  *Tp is set to the template reading continues
+   in, or NULL on error. */
 
+static int read_directive(WebTemplate W, TmplTree t, Template *Tp,
+                          char *line, char *le, char *path)
+{
+   Template T = *Tp;
+   char *m;
    
-/* ------- Template evaluation routines ----------- */
+   /* If in comments, look for end */
+   if (W->cip) {
+      if (LINE_IS(line,le,W->cend,W->lcend)) W->cip = 0;
+      return (1);
+   }
+   /* Look for comment line */
+   if (W->cstart && LINE_IS(line,le,W->cstart,W->lcstart)) {
+      if (W->cend) W->cip = 1;
+      return (1);
+   }
 
+   /* look for dynamic block start */
+   for (m=line;m<le&&*m==' ';m++);
+   if (LINE_IS(m,le,"<!-- BEGIN DYNAMIC BLOCK:",25) ||
+       LINE_IS(m,le,"<!-- BDB:",9)) {
+      *Tp = tree_block(t, T, read_dyn_name(m, le));
+      return (1);
 
+   /* look for dynamic block end */
+   } else if (LINE_IS(m,le,"<!-- END DYNAMIC BLOCK:",23) ||
+              LINE_IS(m,le,"<!-- EDB:",9)) {
+      char *dn = read_dyn_name(m, le);
+      if (strcmp(T->name, dn)) {
+         char emsg[512];
+         snprintf(emsg, 512, "Block %s ended with %s\n", T->name, dn);
+         set_error_string(W, -1, emsg);
+         *Tp = NULL;
+      } else *Tp = T->parent;
+      return (1);
 
-/* Parse (evaluate) a template.  
-   This adds the evaluated content to the parent.
-   We also have to remove the dynamic content after use. */
+   /* look for an include */
+   } else if (LINE_IS(m,le,"<!-- INCLUDE:",13)) {
+      char *ip = read_include_path(m, le, path);
+      TmplTree it = NULL;
+      if (!ip) {
+         char emsg[512];
+         snprintf(emsg, 512, "Include in %s names no file", T->name);
+         set_error_string(W, -1, emsg);
+      } else it = load_include(W, ip);
+      if (it) {
+         splice_template(t, T, it, it->root);
+         t->inc = (TmplTree*) tpl_realloc(t->inc, (t->ninc+1)*sizeof(TmplTree));
+         t->inc[t->ninc++] = it;
+      } else *Tp = NULL;
+      if (ip) tpl_free(ip);
+      return (1);
+   }
+   return (0);
+}
 
-static char *parse_template(Template T)
+/* Read a macro reference at 'm', a '{'.  If it is one, the text
+   before it, from *xp, and the macro are added to the template
+   and *xp moves past it.  Returns where to look on from.
+   A '|' not followed by a known filter is left as text. */
+
+static char *read_macro(TmplTree t, Template T,
+                        char **xp, char *m, char *end)
 {
-   char *r;
-   size_t len = 0;
+   char *n = m+1;   /* name ends at 'e' */
+   char *v = NULL;  /* value ends at 'b' */
+   char *e, *b;
+   int f = TF_NONE;
+   TmplMacro tmac;
    TmplItem ti;
-   TmplItem pi = NULL;
-   char *e;
-   
-   clear_error_string((WebTemplate)T->base);
-   
-   /* see how much space we need */
-   for (ti=T->item;ti;ti=ti->next) {
-      if (ti->type==TI_TEXT || ti->type==TI_DTEXT) len += ti->len;
-      else if (ti->type==TI_MACRO) len += ((TmplMacro)ti->content)->len;
+
+   for (e=n;e<end && (isalnum(*e)||(*e=='_')); e++);
+   b = e;
+   if (e<end && *e == '|') {   /* have a filter */
+      char *fn = e+1;
+      for (b=fn; b<end && isalpha(*b); b++);
+      if (b<end && *b == '}' && !(f=find_filter(fn, b-fn))) b = e;
+   } else if (e<end && *e == '=') {   /* have value assignment */
+      v = e+1;
+      for (b=v; b<end && *b!='}' && *b!='\n'; b++);
+      if (b==end || *b!='}') b = e;
    }
+   if (b==end || *b!='}') return (e<end && *e!='\n'? e+1: e);
 
-   /* copy text */
-   r = (char*) malloc(len+1);
-   e = r;
+   /* macro item */
+   add_text(T, *xp, m-*xp);
    *e = '\0';
-   for (ti=T->item;ti;pi=ti,ti=ti->next) {
-      if (ti->type==TI_TEXT || ti->type==TI_DTEXT) {
-         if (!ti->content) continue;
-         memcpy(e, ti->content, ti->len);
-         e += ti->len;
-         if (ti->type==TI_DTEXT) {
-            free(ti->content);    /* release old dynamic content */
-            if (pi) {
-               pi->next = ti->next;
-               free(ti);
-               ti = pi;
-            }
-         }
-      } else if (ti->type==TI_MACRO) {
-         TmplMacro m = (TmplMacro) ti->content;
-         if (m->value) {
-            memcpy(e, m->value, m->len);
-            e += m->len;
-         }
-      } else if (ti->type==TI_DYNAMIC) { /* make sure pip is reset */
-         ((Template)ti->content)->pip = pi;
-      }
+   tmac = tree_macro(t, n);
+   if (v) {
+      *b = '\0';
+      set_macro_value(tmac, tpl_strdup(v));
    }
-   *e = '\0';
-   return (r);
+   ti = add_item(T, TI_MACRO, NULL, 0);
+   ti->index = tmac->index;
+   ti->filter = f;
+   *xp = b+1;
+   return (b+1);
 }
 
+/* If the '!' at 'p' opens a "<!--" that starts a line, less any
+   indent, return the start of that line. */
 
+static char *directive_line(char *src, char *p, char *end)
+{
+   char *l;
+   if (p==src || p[-1]!='<' || end-p<3 || p[1]!='-' || p[2]!='-') return (NULL);
+   for (l=p-1; l>src && l[-1]==' '; l--);
+   if (l>src && l[-1]!='\n') return (NULL);
+   return (l);
+}
 
+/* Parse a template tree from the whole text of its file.
+   The tree keeps 'src'; its text items point into it.
+   'path' is the file, if known; includes are found relative to it.
+   Text runs on across lines.  Without comment markers only a '{' or
+   the '!' of a "<!--" needs a second look.  With them a line is looked
+   at on its own if it might be a comment or a directive.
+   Return 0 on success, else -1 */
 
-/* Parse a dynamic block 
-   This adds the evaluated template to the parent */
-
-int WebTemplate_parse_dynamic(WebTemplate W, char *dname)
+static int read_template_src(WebTemplate W, TmplTree t, char *src, size_t len,
+                             char *path)
 {
-   Template T;
-   char *v;
+   char *end = src + len;
+   char *l = src;        /* start of a line */
+   char *x = src;        /* start of text not yet added */
+   char *p, *le;
+   Template T = t->root;
 
-   clear_error_string(W);
-   if (!(T=find_template(W, dname))) {
-      set_error_string(W, 1, "template not found");
-      return (1);
+   t->src = src;
+   W->cip = 0;
+   if (!W->cstart) {
+      for (p=src; T && p<end; ) {
+         p = scan_text(p, end, '!');
+         if (p==end) break;
+         if (*p=='{') p = read_macro(t, T, &x, p, end);
+         else if ((l=directive_line(src, p, end))) {
+            le = memchr(l, '\n', end-l);
+            le = le? le+1: end;
+            add_text(T, x, l-x);
+            x = l;
+            if (read_directive(W, t, &T, l, le, path)) x = p = le;
+            else p++;
+         } else p++;
+      }
    }
-   v = parse_template(T);
-   if (v) T->pip = insert_item(T->pip, TI_DTEXT, v);
-   return (0);
-}
 
-/* Parse a plain template 
-   This defines a macro with the evaluated template as its value */
+   else while (T && l<end) {
+
+      /* comments and directives are whole lines */
+      for (p=l; p<end && *p==' '; p++);
+      if (W->cip || (end-p>4 && !memcmp(p, "<!--", 4)) || *l==*W->cstart) {
+         le = memchr(l, '\n', end-l);
+         le = le? le+1: end;
+         add_text(T, x, l-x);
+         x = l;
+         if (read_directive(W, t, &T, l, le, path)) {
+            x = l = le;
+            continue;
+         }
+      }
 
-int WebTemplate_parse(WebTemplate W, char *mname, char *tname)
-{
-   Template T;
-   char *v;
+      /* text and macros, to the end of the line */
+      for (p=l;;) {
+         p = scan_text(p, end, '\n');
+         if (p==end || *p=='\n') break;
+         p = read_macro(t, T, &x, p, end);
+      }
+      l = p<end? p+1: end;
+   }
+   if (T) add_text(T, x, end-x);
 
-   clear_error_string(W);
-   if (!(T=find_template(W, tname))) {
-      set_error_string(W, 1, "template not found");
-      return (1);
+   if (!T) return (-1);
+   
+   if (T->parent) {
+      char emsg[512];
+      snprintf(emsg, 512, "Block %s did not end", T->name);
+      set_error_string(W, -1, emsg);
+      return (-1);
+   }
+
+   if (W->cip) {
+      char emsg[512];
+      snprintf(emsg, 512, "Comment in %s did not end", T->name);
+      set_error_string(W, -1, emsg);
+      return (-1);
    }
-   v = parse_template(T);
-   if (v) add_macro(W->macros, mname, v);
    return (0);
 }
 
+/* Read all of an open file in one go.  A regular file is sized
+   with fstat so it is usually a single allocation and read.
+   The text is null terminated.  Returns NULL on error. */
+
+static char *read_fd_src(int fd, size_t *lenp)
+{
+   struct stat st;
+   size_t size = 8192;
+   size_t len = 0;
+   int r;
+   char *src;
+
+   *lenp = 0;
+   /* +2 leaves room for the null and the read that sees eof */
+   if (fstat(fd, &st)==0 && S_ISREG(st.st_mode)) size = st.st_size + 2;
+   src = (char*) tpl_malloc(size);
+   for (;;) {
+      if (len+1 >= size) {
+         size *= 2;
+         src = (char*) tpl_realloc(src, size);
+      }
+      r = read(fd, src+len, size-len-1);
+      if (r>0) len += r;
+      else if (r==0) break;
+      else if (errno!=EINTR) {
+         tpl_free(src);
+         return (NULL);
+      }
+   }
+   src[len] = '\0';
+   *lenp = len;
+   return (src);
+}
 
+/* Read all of an open FILE. */
 
-/* ------------ Form arguments, parameteres, and cookie tools ---- */
+static char *read_fp_src(FILE *f, size_t *lenp)
+{
+   size_t size = 8192;
+   size_t len = 0;
+   char *src = (char*) tpl_malloc(size);
 
+   *lenp = 0;
+   for (;;) {
+      if (len+1 >= size) {
+         size *= 2;
+         src = (char*) tpl_realloc(src, size);
+      }
+      len += fread(src+len, 1, size-len-1, f);
+      if (len+1 < size) break;
+   }
+   if (ferror(f)) {
+      tpl_free(src);
+      return (NULL);
+   }
+   src[len] = '\0';
+   *lenp = len;
+   return (src);
+}
 
-#define PRINTF if(0)printf
+/* Parse a template from file text.  Replaces any template of the
+   same name, if it parses.  Return 0 on success, else errno or -1 */
 
-/* De-html an arg string. Returns a malloc'd string. */
+/* Has a file that a tree included changed since it was read */
 
-static char *html2text(char *s)
+static int includes_changed(TmplTree t)
 {
-   size_t l;
-   char *out;
-   char *v;
-   long int k;
-   char hex[4];
+   struct stat st;
+   TmplTree it;
+   int i;
 
-   if ((!s)||!*s) return (strdup(""));
-   l = strlen(s);
-   out = (char*) malloc(l+1);
-   v = out;
-   while (*s) {
-      switch (*s) {
-        case '+': *v++ = ' ';
-                  s++;
-                  break;
-        case '%': 
-                  if (isxdigit(s[1])&&isxdigit(s[2])) {
-                     hex[0] = *++s;
-                     hex[1] = *++s;
-                     hex[2] = '\0';
-                     k = strtol(hex,0,16);
-                     *v++ = (char)k;
-                     s++;
-                  } else {   // not a hex encoding
-                     *v++ = *s++;
-                  }
-                  break;
-        case 0x0d: s++;  /* cr */
-                  break;
-        default:  *v++ = *s++;
-      }
+   for (i=0; i<t->ninc; i++) {
+      it = t->inc[i];
+      if (stat(it->path, &st) || st.st_mtime!=it->mtime ||
+          MTIME_NS(&st)!=it->mtime_ns ||
+          st.st_size!=it->size || st.st_ino!=it->ino ||
+          includes_changed(it)) return (1);
    }
-   *v-- = '\0';
-   while ( (v>out) && (*v=='\n'||*v=='\r')) *v-- = '\0';
-   return (out);
+   return (0);
 }
 
-/* convert special chars to html */
+/* Is a cached include the file read with these comment markers? */
 
-static char *text2html(char *s)
+static int same_include(TmplTree t, char *path, char *cstart, char *cend)
 {
-   char *out;
-   char *v;
+   if (strcmp(t->path, path)) return (0);
+   if (!t->cstart != !cstart || (cstart && strcmp(t->cstart, cstart))) return (0);
+   if (!t->cend != !cend || (cend && strcmp(t->cend, cend))) return (0);
+   return (1);
+}
+
+/* Find an included file in the set's cache, if it has not changed */
+
+static TmplTree cached_include(WebTemplate W, char *path, struct stat *st)
+{
+   TmplSet S = W->set;
+   TmplTree t = NULL;
+   int i;
+
+   LOCK_SET(S);
+   for (i=0; i<S->ninc; i++) {
+      t = S->inc[i];
+      if (same_include(t, path, W->cstart, W->cend)) break;
+   }
+   if (i<S->ninc && t->mtime==st->st_mtime && t->mtime_ns==MTIME_NS(st) &&
+       t->size==st->st_size && t->ino==st->st_ino) ATOMIC_INC(&t->refs);
+   else t = NULL;
+   UNLOCK_SET(S);
+   if (t && includes_changed(t)) {
+      release_tree(t);
+      t = NULL;
+   }
+   return (t);
+}
+
+/* Read an included file, or take it from the set's cache.
+   A file read is cached in place of any older copy read with
+   the same comment markers.
+   Returns the tree, held for the caller, or NULL on error. */
+
+static TmplTree load_include(WebTemplate W, char *path)
+{
+   TmplSet S = W->set;
+   TmplTree t, old = NULL;
+   struct stat st;
+   char emsg[512];
+   char *src;
+   size_t len;
+   int fd, i;
+
+   if (W->include == TPL_MAX_INCLUDE) {
+      snprintf(emsg, 512, "Includes nest too deeply at %s", path);
+      set_error_string(W, -1, emsg);
+      return (NULL);
+   }
+   fd = open(path, O_RDONLY, 0);
+   if (fd<0 || fstat(fd, &st)) {
+      snprintf(emsg, 512, "Include %s: %s", path, strerror(errno));
+      set_error_string(W, -1, emsg);
+      if (fd>=0) close(fd);
+      return (NULL);
+   }
+   if ((t=cached_include(W, path, &st))) {
+      close(fd);
+      return (t);
+   }
+   src = read_fd_src(fd, &len);
+   close(fd);
+   if (!src) {
+      snprintf(emsg, 512, "Include %s: %s", path, strerror(errno));
+      set_error_string(W, -1, emsg);
+      return (NULL);
+   }
+
+   t = new_tree(path);
+   t->path = tpl_strdup(path);
+   if (W->cstart) t->cstart = tpl_strdup(W->cstart);
+   if (W->cend) t->cend = tpl_strdup(W->cend);
+   t->mtime = st.st_mtime;
+   t->mtime_ns = MTIME_NS(&st);
+   t->size = st.st_size;
+   t->ino = st.st_ino;
+   W->include++;
+   i = read_template_src(W, t, src, len, path);
+   W->include--;
+   if (i) {
+      release_tree(t);
+      return (NULL);
+   }
+   finish_tree(t);
+
+   t->refs = 2;   /* the cache's and the caller's */
+   LOCK_SET(S);
+   for (i=0; i<S->ninc; i++) {
+      if (same_include(S->inc[i], path, W->cstart, W->cend)) break;
+   }
+   if (i<S->ninc) old = S->inc[i];
+   else S->inc = (TmplTree*) tpl_realloc(S->inc, (++S->ninc)*sizeof(TmplTree));
+   S->inc[i] = t;
+   UNLOCK_SET(S);
+   release_tree(old);
+   return (t);
+}
+
+static int load_template(WebTemplate W, char *name, char *src, size_t len,
+                         char *path, struct stat *st)
+{
+   TmplTree t;
+   if (!src) {
+      set_error_string(W, errno, NULL);
+      return (errno);
+   }
+   t = new_tree(name);
+   if (read_template_src(W, t, src, len, path)) {
+      release_tree(t);
+      return (-1);
+   }
+   install_tree(W, name, t, path, st);
+   return (0);
+}
+
+/* -------- Template images ------------- */
+
+/* Add bytes to an image's string pool.  Returns the pool offset. */
+
+static unsigned int image_pool(TmplImageBuild B, char *s, size_t len, int nul)
+{
+   unsigned int off = B->npool;
+   if (B->npool + len + 1 > B->apool) {
+      B->apool = 2 * (B->npool + len + 1);
+      B->pool = (char*) tpl_realloc(B->pool, B->apool);
+   }
+   if (len) memcpy(B->pool+B->npool, s, len);
+   B->npool += len;
+   if (nul) B->pool[B->npool++] = '\0';
+   return (off);
+}
+
+/* Add an item record.  Returns its index. */
+
+static unsigned int image_item(TmplImageBuild B, int type)
+{
+   TmplImageItem_ *r;
+   if (B->nitem==B->aitem) {
+      B->aitem = B->aitem? 2*B->aitem: 64;
+      B->item = (TmplImageItem_*) tpl_realloc(B->item,
+                                   B->aitem*sizeof(TmplImageItem_));
+   }
+   r = B->item + B->nitem;
+   r->type = type;
+   r->filter = TF_NONE;
+   r->off = 0;
+   r->len = 0;
+   r->value = TPL_NONE;
+   return (B->nitem++);
+}
+
+/* Add a template's records.  Its dynamic blocks follow it.
+   Returns the template record. */
+
+static unsigned int image_template(TmplImageBuild B, TmplTree tree, Template T,
+                                   int plain)
+{
+   unsigned int t, i, first;
+   TmplItem ti;
+   int j;
+
+   if (B->ntmpl==B->atmpl) {
+      B->atmpl = B->atmpl? 2*B->atmpl: 16;
+      B->tmpl = (TmplImageTemplate_*) tpl_realloc(B->tmpl,
+                                   B->atmpl*sizeof(TmplImageTemplate_));
+   }
+   t = B->ntmpl++;
+   B->tmpl[t].name = image_pool(B, T->name, strlen(T->name), 1);
+   B->tmpl[t].plain = plain;
+
+   first = B->nitem;
+   for (j=0; j<T->nitem; j++) {
+      ti = T->item + j;
+      i = image_item(B, ti->type);
+      if (ti->type==TI_TEXT) {
+         B->item[i].off = image_pool(B, (char*) ti->content, ti->len, 0);
+         B->item[i].len = ti->len;
+      } else if (ti->type==TI_MACRO) {
+         TmplMacro m = tree->mac[ti->index];
+         B->item[i].filter = ti->filter;
+         B->item[i].off = image_pool(B, m->name, strlen(m->name), 1);
+         if (m->type==TM_TEXT && m->value)
+            B->item[i].value = image_pool(B, m->value, m->len, 1);
+      }
+   }
+   B->tmpl[t].item = first;
+   B->tmpl[t].nitem = B->nitem - first;
+
+   /* blocks always have later records than their parent */
+   for (j=0; j<T->nitem; j++) {
+      ti = T->item + j;
+      if (ti->type==TI_DYNAMIC) {
+         unsigned int d = image_template(B, tree, (Template)ti->content, 0);
+         B->item[first+j].off = d;
+      }
+   }
+   return (t);
+}
+
+/* Is there a string at 'off' in the pool */
+
+static int image_string(char *pool, size_t npool, unsigned int off)
+{
+   return (off<npool && memchr(pool+off, '\0', npool-off)!=NULL);
+}
+
+/* Check an image before anything is made from it.
+   Returns 0 if it is sound. */
+
+static int check_image(char *base, size_t size)
+{
+   TmplImageHead_ *H = (TmplImageHead_*) base;
+   TmplImageTemplate_ *tr;
+   TmplImageItem_ *ir;
+   char *pool;
+   size_t npool;
+   unsigned int t, i;
+
+   if (size<sizeof(TmplImageHead_)) return (-1);
+   if (memcmp(H->magic, TPL_IMAGE_MAGIC, 8) ||
+       H->version!=TPL_IMAGE_VERSION ||
+       H->order!=TPL_IMAGE_ORDER ||
+       H->size!=size) return (-1);
+   if (H->ntemplate>size/sizeof(TmplImageTemplate_) ||
+       H->nitem>size/sizeof(TmplImageItem_)) return (-1);
+   if (H->pool!=sizeof(TmplImageHead_) +
+                (size_t)H->ntemplate*sizeof(TmplImageTemplate_) +
+                (size_t)H->nitem*sizeof(TmplImageItem_) ||
+       H->pool>size) return (-1);
+
+   tr = (TmplImageTemplate_*) (H+1);
+   ir = (TmplImageItem_*) (tr + H->ntemplate);
+   pool = base + H->pool;
+   npool = size - H->pool;
+   for (t=0;t<H->ntemplate;t++) {
+      if (!image_string(pool, npool, tr[t].name)) return (-1);
+      if (tr[t].item>H->nitem || tr[t].nitem>H->nitem-tr[t].item) return (-1);
+      for (i=tr[t].item;i<tr[t].item+tr[t].nitem;i++) {
+         TmplImageItem_ *r = ir + i;
+         if (r->type==TI_TEXT) {
+            if (r->off>npool || r->len>npool-r->off) return (-1);
+         } else if (r->type==TI_MACRO) {
+            if (!image_string(pool, npool, r->off) || r->filter>TF_JS) return (-1);
+            if (r->value!=TPL_NONE && !image_string(pool, npool, r->value))
+               return (-1);
+         } else if (r->type==TI_DYNAMIC) {
+            /* a block must come later, so there can be no loops */
+            if (r->off<=t || r->off>=H->ntemplate || tr[r->off].plain)
+               return (-1);
+         } else return (-1);
+      }
+   }
+   return (0);
+}
+
+/* Make a template's items from an image.  Text points into the image. */
+
+static void image_items(TmplTree tree, TmplImage I, Template T, unsigned int t)
+{
+   TmplImageHead_ *H = (TmplImageHead_*) I->base;
+   TmplImageTemplate_ *tr = (TmplImageTemplate_*) (H+1);
+   TmplImageItem_ *ir = (TmplImageItem_*) (tr + H->ntemplate);
+   char *pool = I->base + H->pool;
+   unsigned int i;
+
+   for (i=tr[t].item;i<tr[t].item+tr[t].nitem;i++) {
+      TmplImageItem_ *r = ir + i;
+      if (r->type==TI_TEXT) {
+         if (r->len) add_item(T, TI_TEXT, pool+r->off, r->len);
+      } else if (r->type==TI_MACRO) {
+         TmplMacro m = tree_macro(tree, pool+r->off);
+         TmplItem ti = add_item(T, TI_MACRO, NULL, 0);
+         if (r->value!=TPL_NONE)
+            set_macro_value_b(m, pool+r->value, strlen(pool+r->value), MV_REF);
+         ti->index = m->index;
+         ti->filter = r->filter;
+      } else {
+         Template D = tree_block(tree, T, pool+tr[r->off].name);
+         image_items(tree, I, D, r->off);
+      }
+   }
+}
+
+/* -------- Fragment cache ------------- */
+
+/* xxHash64, of input in pieces.  It tags pages and keys the cache. */
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+#define XXH_ROTL(x,r) (((x) << (r)) | ((x) >> (64-(r))))
+
+static unsigned long long xxh_read(unsigned char *p, int n)
+{
+   unsigned long long v = 0;
+   while (n--) v = (v << 8) | p[n];
+   return (v);
+}
+
+static unsigned long long xxh_round(unsigned long long acc, unsigned long long in)
+{
+   acc += in * XXH_P2;
+   acc = XXH_ROTL(acc, 31);
+   return (acc * XXH_P1);
+}
+
+static void hash_init(TmplHash H)
+{
+   H->v[0] = XXH_P1 + XXH_P2;
+   H->v[1] = XXH_P2;
+   H->v[2] = 0;
+   H->v[3] = 0 - XXH_P1;
+   H->total = 0;
+   H->len = 0;
+}
+
+static void hash_stripe(TmplHash H, unsigned char *p)
+{
+   H->v[0] = xxh_round(H->v[0], xxh_read(p, 8));
+   H->v[1] = xxh_round(H->v[1], xxh_read(p+8, 8));
+   H->v[2] = xxh_round(H->v[2], xxh_read(p+16, 8));
+   H->v[3] = xxh_round(H->v[3], xxh_read(p+24, 8));
+}
+
+static void hash_update(TmplHash H, char *s, size_t len)
+{
+   unsigned char *p = (unsigned char*) s;
+   size_t n;
+
+   H->total += len;
+   if (H->len) {
+      n = 32 - H->len;
+      if (n > len) n = len;
+      memcpy(H->buf+H->len, p, n);
+      H->len += n;
+      p += n;
+      len -= n;
+      if (H->len < 32) return;
+      hash_stripe(H, H->buf);
+      H->len = 0;
+   }
+   for (; len>=32; p+=32, len-=32) hash_stripe(H, p);
+   memcpy(H->buf, p, len);
+   H->len = len;
+}
+
+static unsigned long long hash_final(TmplHash H)
+{
+   unsigned long long h;
+   unsigned char *p = H->buf;
+   size_t len = H->len;
+   int i;
+
+   if (H->total >= 32) {
+      h = XXH_ROTL(H->v[0], 1) + XXH_ROTL(H->v[1], 7) +
+          XXH_ROTL(H->v[2], 12) + XXH_ROTL(H->v[3], 18);
+      for (i=0; i<4; i++) {
+         h ^= xxh_round(0, H->v[i]);
+         h = h * XXH_P1 + XXH_P4;
+      }
+   } else h = XXH_P5;
+   h += H->total;
+   for (; len>=8; p+=8, len-=8) {
+      h ^= xxh_round(0, xxh_read(p, 8));
+      h = XXH_ROTL(h, 27) * XXH_P1 + XXH_P4;
+   }
+   if (len>=4) {
+      h ^= xxh_read(p, 4) * XXH_P1;
+      h = XXH_ROTL(h, 23) * XXH_P2 + XXH_P3;
+      p += 4;
+      len -= 4;
+   }
+   for (; len; p++, len--) {
+      h ^= *p * XXH_P5;
+      h = XXH_ROTL(h, 11) * XXH_P1;
+   }
+   h ^= h >> 33;
+   h *= XXH_P2;
+   h ^= h >> 29;
+   h *= XXH_P3;
+   h ^= h >> 32;
+   return (h);
+}
+
+/* Take a render out of the cache's lists */
+
+static void cache_unlink(TmplCache C, TmplFrag f)
+{
+   if (f->newer) f->newer->older = f->older;
+   else C->newest = f->older;
+   if (f->older) f->older->newer = f->newer;
+   else C->oldest = f->newer;
+}
+
+static void cache_front(TmplCache C, TmplFrag f)
+{
+   f->newer = NULL;
+   f->older = C->newest;
+   if (C->newest) C->newest->newer = f;
+   else C->oldest = f;
+   C->newest = f;
+}
+
+static void cache_drop(TmplCache C, TmplFrag f)
+{
+   TmplFrag *fp = C->slot + (f->hash & (C->nslot-1));
+
+   while (*fp!=f) fp = &(*fp)->next;
+   *fp = f->next;
+   cache_unlink(C, f);
+   C->size -= sizeof(TmplFrag_) + f->klen + f->len;
+   C->count--;
+   release_tree(f->tree);
+   tpl_free(f);
+}
+
+/* Drop the least recently used until 'need' more bytes fit */
+
+static void cache_trim(TmplCache C, size_t need)
+{
+   while (C->oldest && C->size+need > C->limit) cache_drop(C, C->oldest);
+}
+
+static void free_cache(TmplCache C)
+{
+   C->limit = 0;
+   cache_trim(C, 1);
+   tpl_free(C->slot);
+   tpl_free(C);
+}
+
+/* Does a kept render have the values now used? */
+
+static int cache_match(TmplFrag f, TmplBind B, Template T)
+{
+   char *k = f->key;
+   TmplMacro m;
+   size_t n;
+   int u;
+
+   for (u=0; u<T->nused; u++) {
+      m = B->mac[T->used[u]];
+      memcpy(&n, k, sizeof(n));
+      k += sizeof(n);
+      if (n != (m->value? m->len: (size_t)-1)) return (0);
+      if (m->value && memcmp(k, m->value, n)) return (0);
+      if (m->value) k += n;
+   }
+   return (1);
+}
+
+/* Find a template's render with the current values of its macros.
+   If there is none the hash is left for cache_add.  A template
+   with dynamic text or a deferred parse in it is not kept. */
+
+static TmplFrag cache_find(TmplCache C, TmplBind B, Template T)
+{
+   TmplHash_ H;
+   TmplFrag f;
+   TmplMacro m;
+   TmplItem ti;
+   size_t n;
+   int v;
+
+   C->keyed = 0;
+   for (v=0; v<T->nvar; v++) {
+      ti = T->item + T->var[v];
+      if (ti->type==TI_DYNAMIC && B->dyn[ti->index].len) return (NULL);
+   }
+   hash_init(&H);
+   hash_update(&H, (char*) &T, sizeof(T));
+   for (v=0; v<T->nused; v++) {
+      m = B->mac[T->used[v]];
+      if (m->type==TM_TMPL) return (NULL);
+      if (m->type!=TM_TEXT) format_macro(m);
+      n = m->value? m->len: (size_t)-1;
+      hash_update(&H, (char*) &n, sizeof(n));
+      if (m->value) hash_update(&H, m->value, m->len);
+   }
+   C->hash = hash_final(&H);
+   C->keyed = 1;
+
+   for (f=C->slot[C->hash & (C->nslot-1)]; f; f=f->next) {
+      if (f->hash==C->hash && f->T==T && f->tree==B->tree &&
+          cache_match(f, B, T)) break;
+   }
+   if (!f) {
+      C->misses++;
+      return (NULL);
+   }
+   C->hits++;
+   cache_unlink(C, f);
+   cache_front(C, f);
+   return (f);
+}
+
+/* Keep a render, by the hash of the last lookup */
+
+static void cache_add(TmplCache C, TmplBind B, Template T, char *text, size_t len)
+{
+   size_t klen = 0, need, i, n;
+   TmplFrag f, *fp;
+   TmplMacro m;
+   char *k;
+   int u;
+
+   for (u=0; u<T->nused; u++) {
+      m = B->mac[T->used[u]];
+      klen += sizeof(size_t) + (m->value? m->len: 0);
+   }
+   need = sizeof(TmplFrag_) + klen + len;
+   if (need > C->limit) return;
+   cache_trim(C, need);
+   if (C->count >= C->nslot) {   /* double the slots */
+      TmplFrag *slot = (TmplFrag*) tpl_malloc(2*C->nslot*sizeof(TmplFrag));
+      memset(slot, '\0', 2*C->nslot*sizeof(TmplFrag));
+      for (i=0; i<C->nslot; i++) {
+         while ((f=C->slot[i])) {
+            C->slot[i] = f->next;
+            fp = slot + (f->hash & (2*C->nslot-1));
+            f->next = *fp;
+            *fp = f;
+         }
+      }
+      tpl_free(C->slot);
+      C->slot = slot;
+      C->nslot *= 2;
+   }
+   f = (TmplFrag) tpl_malloc(need);
+   f->tree = B->tree;
+   ATOMIC_INC(&f->tree->refs);
+   f->T = T;
+   f->hash = C->hash;
+   f->key = k = (char*) (f+1);
+   f->klen = klen;
+   for (u=0; u<T->nused; u++) {
+      m = B->mac[T->used[u]];
+      n = m->value? m->len: (size_t)-1;
+      memcpy(k, &n, sizeof(n));
+      k += sizeof(n);
+      if (m->value) memcpy(k, m->value, n);
+      if (m->value) k += n;
+   }
+   f->text = k;
+   f->len = len;
+   memcpy(f->text, text, len);
+   fp = C->slot + (f->hash & (C->nslot-1));
+   f->next = *fp;
+   *fp = f;
+   cache_front(C, f);
+   C->size += need;
+   C->count++;
+}
+
+static TmplCache new_cache(size_t limit)
+{
+   TmplCache C = (TmplCache) tpl_malloc(sizeof(TmplCache_));
+   memset(C, '\0', sizeof(TmplCache_));
+   C->nslot = 64;
+   C->slot = (TmplFrag*) tpl_malloc(C->nslot*sizeof(TmplFrag));
+   memset(C->slot, '\0', C->nslot*sizeof(TmplFrag));
+   C->limit = limit;
+   return (C);
+}
+
+/* ------ API template calls -------- */
+
+/* Create a web template using a template set */
+static WebTemplate new_instance(TmplSet S)
+{
+   WebTemplate W = (WebTemplate) tpl_malloc(sizeof(WebTemplate_));
+   W->set = S;
+   W->bind = NULL;
+   W->nbind = 0;
+   W->dhandle = NULL;
+   W->source = NULL;
+   W->macros = new_table();
+   W->arg = malloc_macro("-");
+   W->in_cookie = malloc_macro("-");
+   W->header = malloc_macro("-");
+   W->octet = malloc_macro("-");
+   W->header_sent = 0;
+   W->content_length = 0;
+   W->out.fn = NULL;
+   W->out.ctx = NULL;
+   W->out.fd = 1;
+   W->out.buf = NULL;
+   W->out.size = TPL_OUT_SIZE;
+   W->out.len = 0;
+   W->out.err = 0;
+   W->out.gzip = 0;
+   W->out.gz = NULL;
+   W->out.etag[0] = '\0';
+   W->out.not_modified = 0;
+   W->out.sized = 0;
+   W->compress = 0;
+   W->etag = 0;
+   memset(&W->iov, '\0', sizeof(TmplIov_));
+   W->cstart = NULL;
+   W->cend = NULL;
+   W->cip = 0;
+   W->include = 0;
+   W->error_string = NULL;
+   W->arena = NULL;
+   W->defer = NULL;
+   W->deferred = 0;
+   W->cache = NULL;
+   return (W);
+}
+
+/* Create a web template */
+WebTemplate WebTemplate_new()
+{
+   return (new_instance(new_set()));
+}
+WebTemplate newWebTemplate()
+{
+   return (WebTemplate_new());
+}
+
+/* Get a web template's template set, to share with other
+   instances.  Release it with WebTemplate_free_set. */
+TmplSet WebTemplate_get_set(WebTemplate W)
+{
+   clear_error_string(W);
+   ATOMIC_INC(&W->set->refs);
+   return (W->set);
+}
+
+/* Create a web template that uses a shared template set */
+WebTemplate WebTemplate_new_with_set(TmplSet S)
+{
+   ATOMIC_INC(&S->refs);
+   return (new_instance(S));
+}
+
+/* Release a template set.  It is freed when no
+   web template is using it. */
+void WebTemplate_free_set(TmplSet S)
+{
+   if (S) release_set(S);
+}
+
+static int out_finish(WebTemplate W);
+
+void WebTemplate_free(WebTemplate W)
+{
+   if (W) {
+     TmplDynHandle h;
+     TmplSource r;
+     int s;
+     if (W->out.gz && W->out.gz->on) out_finish(W);   /* the page's end */
+     while ((h=W->dhandle)) {
+        W->dhandle = h->next;
+        release_tree(h->tree);
+        tpl_free(h);
+     }
+     while ((r=W->source)) {
+        W->source = r->next;
+        release_tree(r->tree);
+        tpl_free(r);
+     }
+     while (W->defer) free_defer(W, W->defer);
+     if (W->cache) free_cache(W->cache);
+     for (s=0; s<W->nbind; s++) unbind(W->bind+s);
+     if (W->bind) tpl_free(W->bind);
+     release_set(W->set);
+     free_table(W->macros);
+     free_macros(W->arg);
+     free_macros(W->in_cookie);
+     free_macros(W->header);
+     free_macros(W->octet);
+     if (W->error_string) tpl_free(W->error_string);
+     if (W->cstart) tpl_free(W->cstart);
+     if (W->cend) tpl_free(W->cend);
+     if (W->arena) free_arena(W->arena);
+     if (W->out.buf) tpl_free(W->out.buf);
+     if (W->out.gz) {
+#ifdef HAVE_LIBZ
+        deflateEnd((z_stream*) W->out.gz->zs);
+#endif
+        tpl_free(W->out.gz->zs);
+        if (W->out.gz->hold) tpl_free(W->out.gz->hold);
+        tpl_free(W->out.gz);
+     }
+     if (W->iov.iov) tpl_free(W->iov.iov);
+     if (W->iov.text) tpl_free(W->iov.text);
+     tpl_free(W);
+   }
+}
+void freeWebTemplate(WebTemplate W)
+{
+   WebTemplate_free(W);
+}
+
+/* set the output fd - default is stdout */
+void WebTemplate_set_output(WebTemplate W, int fd)
+{
+   clear_error_string(W);
+   W->out.fn = NULL;
+   W->out.fd = fd;
+}
+
+/* Send output to a function instead of an fd.  It is called with
+   'ctx' and a buffer of output, and returns 0, or an errno.
+   A null function sends output to the fd again. */
+void WebTemplate_set_sink(WebTemplate W, TmplSinkFn fn, void *ctx)
+{
+   clear_error_string(W);
+   W->out.fn = fn;
+   W->out.ctx = ctx;
+}
+
+/* Set the size of the output buffer.  Output is sent when the
+   buffer fills and at the end of each call that writes. */
+void WebTemplate_set_output_buffer(WebTemplate W, size_t size)
+{
+   clear_error_string(W);
+   if (W->out.buf) tpl_free(W->out.buf);
+   W->out.buf = NULL;
+   W->out.size = size<TPL_OUT_MIN? TPL_OUT_MIN: size;
+}
+
+/* set for no headers - e.g. output to html file */
+void WebTemplate_set_noheader(WebTemplate W)
+{
+   clear_error_string(W);
+   W->header_sent = 1;
+}
+
+/* set comment designators  */
+void WebTemplate_set_comments(WebTemplate W, char *start, char *end)
+{
+   clear_error_string(W);
+   if (W->cstart) tpl_free(W->cstart);
+   if (W->cend) tpl_free(W->cend);
+   W->cend = NULL;
+
+   if (start && *start) {
+      W->cstart = tpl_strdup(start);
+      W->lcstart = strlen(start);
+      if (end && *end) {
+         W->cend = tpl_strdup(end);
+         W->lcend = strlen(end);
+      }
+   } else W->cstart = NULL;
+}
+
+
+/* Assign 'len' bytes to a macro.  The value may contain nulls.
+   Zero length clears the macro. */
+
+void WebTemplate_assign_n(WebTemplate W, char *name, char *value, size_t len)
+{
+   TmplMacro m;
+   char *v;
+   int own;
+   clear_error_string(W);
+   if (name) {
+      if (value && len) {
+         v = request_alloc(W, len+1, &own);
+         memcpy(v, value, len);
+         v[len] = '\0';
+         m = add_indexed_macro(W->macros, name, NULL);
+         if (W->defer) changing(W, m);
+         set_macro_value_b(m, v, len, own);
+      } else if ((m=find_indexed_macro(W->macros, name))) {
+         if (W->defer) changing(W, m);
+         set_macro_value(m, NULL);
+      }
+   }
+}
+
+
+/* Assign a value to a macro.
+   Null value clears the macro. */
+
+void WebTemplate_assign(WebTemplate W, char *name, char *value)
+{
+   WebTemplate_assign_n(W, name, value, value? strlen(value): 0);
+}
+
+
+/* Assign a value to a macro without copying it.  The caller's
+   buffer must stay valid until the macro is reassigned or
+   the WebTemplate is freed.  Zero length clears the macro. */
+
+void WebTemplate_assign_ref(WebTemplate W, char *name, char *value, size_t len)
+{
+   TmplMacro m;
+   clear_error_string(W);
+   if (name) {
+      if (value && len) {
+         m = add_indexed_macro(W->macros, name, NULL);
+         if (W->defer) changing(W, m);
+         set_macro_value_b(m, value, len, MV_REF);
+      } else if ((m=find_indexed_macro(W->macros, name))) {
+         if (W->defer) changing(W, m);
+         set_macro_value(m, NULL);
+      }
+   }
+}
+
+
+/* Get a handle to a macro, defining it if necessary.
+   The handle is good for the life of the WebTemplate. */
+
+TmplMacro WebTemplate_macro_handle(WebTemplate W, char *name)
+{
+   clear_error_string(W);
+   if (!name) return (NULL);
+   return (add_indexed_macro(W->macros, name, NULL));
+}
+
+/* Assign a value to a macro by handle.
+   Null value clears the macro. */
+
+void WebTemplate_assign_h(WebTemplate W, TmplMacro h, char *value)
+{
+   char *v;
+   int own;
+   clear_error_string(W);
+   if (!h) return;
+   if (W->defer) changing(W, h);
+   if (value && *value) {
+      v = request_strdup(W, value, &own);
+      set_macro_value_b(h, v, strlen(v), own);
+   } else set_macro_value(h, NULL);
+}
+
+/* Typed values.  These are stored in binary and formatted
+   only when the macro is used. */
+
+void WebTemplate_assign_long_h(WebTemplate W, TmplMacro h, long value)
+{
+   clear_error_string(W);
+   if (!h) return;
+   if (W->defer) changing(W, h);
+   set_macro_type(h, TM_LONG)->num.l = value;
+}
+
+void WebTemplate_assign_long(WebTemplate W, char *name, long value)
+{
+   clear_error_string(W);
+   if (name) WebTemplate_assign_long_h(W,
+                add_indexed_macro(W->macros, name, NULL), value);
+}
+
+/* 'prec' is the number of digits after the decimal point */
+
+void WebTemplate_assign_double_h(WebTemplate W, TmplMacro h,
+     double value, int prec)
+{
+   clear_error_string(W);
+   if (h) {
+      if (W->defer) changing(W, h);
+      set_macro_type(h, TM_DOUBLE)->num.d = value;
+      h->prec = prec;
+   }
+}
+
+void WebTemplate_assign_double(WebTemplate W, char *name, double value, int prec)
+{
+   clear_error_string(W);
+   if (name) WebTemplate_assign_double_h(W,
+                add_indexed_macro(W->macros, name, NULL), value, prec);
+}
+
+/* 'fmt' is a strftime format, for local time.  It is not copied,
+   and must stay valid until the macro is used or reassigned. */
+
+void WebTemplate_assign_time(WebTemplate W, char *name, time_t value, char *fmt)
+{
+   TmplMacro m;
+   clear_error_string(W);
+   if (name && fmt) {
+      m = add_indexed_macro(W->macros, name, NULL);
+      if (W->defer) changing(W, m);
+      set_macro_type(m, TM_TIME);
+      m->num.t = value;
+      m->fmt = fmt;
+   }
+}
+
+
+/* Assign an integer value to a macro by handle. */
+
+void WebTemplate_assign_int_h(WebTemplate W, TmplMacro h, int value)
+{
+   WebTemplate_assign_long_h(W, h, (long)value);
+}
+
+/* Assign an integer value to a macro. */
+
+void WebTemplate_assign_int(WebTemplate W, char *name, int value)
+{
+   WebTemplate_assign_long(W, name, (long)value);
+}
+
+
+/* Load a template from an open socket */
+int WebTemplate_get_by_fd(WebTemplate W, char *name, int fd)
+{
+   char *src;
+   size_t len;
+   int ret;
+   clear_error_string(W);
+   src = read_fd_src(fd, &len);
+   ret = load_template(W, name, src, len, NULL, NULL);
+   close(fd);
+   return (ret);
+}
+
+/* Load a template from an open file */
+int WebTemplate_get_by_fp(WebTemplate W, char *name, FILE *f)
+{
+   char *src;
+   size_t len;
+   clear_error_string(W);
+   if (!f) return (errno);
+   src = read_fp_src(f, &len);
+   return (load_template(W, name, src, len, NULL, NULL));
+}
+
+/* Load a template from a file.  The file is noted for reloads. */
+int WebTemplate_get_by_name(WebTemplate W, char *name, char *filename)
+{
+   struct stat st;
+   char *src;
+   size_t len;
+   int s;
+   int fd;
+   clear_error_string(W);
+   fd = open(filename,O_RDONLY,0);
+   if (fd<0 || fstat(fd, &st)) {
+      set_error_string(W, errno, NULL);
+      if (fd>=0) close(fd);
+      return(errno);
+   }
+   src = read_fd_src(fd, &len);
+   s = load_template(W, name, src, len, filename, &st);
+   close(fd);
+   return (s);
+}
+
+/* Check template files for changes every 'seconds', and
+   reload those that have changed.  Zero turns reloads off. */
+void WebTemplate_set_reload(WebTemplate W, int seconds)
+{
+   clear_error_string(W);
+   W->set->reload = seconds>0? seconds: 0;
+}
+
+/* Save all templates as a compiled image.  The image is written
+   beside the file and renamed, so a reader never sees part of one. */
+int WebTemplate_save_image(WebTemplate W, char *filename)
+{
+   TmplImageBuild_ B;
+   TmplImageHead_ H;
+   TmplTree *tree;
+   int ntree, s;
+   size_t hlen;
+   char *tmp;
+   FILE *f;
+   int ret = 0;
+
+   clear_error_string(W);
+   memset(&B, 0, sizeof(B));
+   LOCK_SET(W->set);
+   ntree = W->set->nslot;
+   tree = (TmplTree*) tpl_malloc((ntree+1)*sizeof(TmplTree));
+   for (s=0; s<ntree; s++) {
+      if ((tree[s]=W->set->slot[s]->tree)) ATOMIC_INC(&tree[s]->refs);
+   }
+   UNLOCK_SET(W->set);
+   for (s=0; s<ntree; s++) if (tree[s]) image_template(&B, tree[s], tree[s]->root, 1);
+
+   memset(&H, 0, sizeof(H));
+   memcpy(H.magic, TPL_IMAGE_MAGIC, 8);
+   H.version = TPL_IMAGE_VERSION;
+   H.order = TPL_IMAGE_ORDER;
+   H.ntemplate = B.ntmpl;
+   H.nitem = B.nitem;
+   hlen = sizeof(H) + B.ntmpl*sizeof(TmplImageTemplate_) +
+          B.nitem*sizeof(TmplImageItem_);
+   H.pool = hlen;
+   H.size = hlen + B.npool;
+
+   tmp = (char*) tpl_malloc(strlen(filename)+5);
+   sprintf(tmp, "%s.tmp", filename);
+   if (hlen+B.npool >= TPL_NONE) {
+      set_error_string(W, -1, "Template image too large");
+      ret = -1;
+   } else if (!(f=fopen(tmp, "wb"))) {
+      ret = errno;
+   } else {
+      if (fwrite(&H, sizeof(H), 1, f)!=1 ||
+          fwrite(B.tmpl, sizeof(TmplImageTemplate_), B.ntmpl, f)!=B.ntmpl ||
+          fwrite(B.item, sizeof(TmplImageItem_), B.nitem, f)!=B.nitem ||
+          fwrite(B.pool, 1, B.npool, f)!=B.npool) ret = errno? errno: -1;
+      if (fclose(f) && !ret) ret = errno? errno: -1;
+#ifdef WIN32
+      if (!ret) remove(filename);
+#endif
+      if (!ret && rename(tmp, filename)) ret = errno;
+      if (ret) remove(tmp);
+   }
+   if (ret>0) set_error_string(W, ret, NULL);
+   tpl_free(tmp);
+   for (s=0; s<ntree; s++) release_tree(tree[s]);
+   tpl_free(tree);
+   if (B.tmpl) tpl_free(B.tmpl);
+   if (B.item) tpl_free(B.item);
+   if (B.pool) tpl_free(B.pool);
+   return (ret);
+}
+
+/* Load templates from a compiled image.  The image is mapped
+   read-only, so processes share one copy of the template text. */
+int WebTemplate_load_image(WebTemplate W, char *filename)
+{
+   TmplImage I;
+   TmplImageHead_ *H;
+   TmplImageTemplate_ *tr;
+   TmplTree tree;
+   struct stat st;
+   char *base = NULL;
+   size_t size;
+   int mapped = 0;
+   unsigned int t;
+   int fd;
+
+   clear_error_string(W);
+   fd = open(filename,O_RDONLY,0);
+   if (fd<0) {
+      set_error_string(W, errno, NULL);
+      return(errno);
+   }
+#ifndef WIN32
+   if (fstat(fd, &st)==0 && S_ISREG(st.st_mode) && st.st_size>0) {
+      size = st.st_size;
+      base = (char*) mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (base==MAP_FAILED) base = NULL;
+      else mapped = 1;
+   }
+#endif
+   if (!mapped) base = read_fd_src(fd, &size);
+   close(fd);
+   if (!base) {
+      set_error_string(W, errno, NULL);
+      return (errno);
+   }
+
+   I = (TmplImage) tpl_malloc(sizeof(TmplImage_));
+   I->refs = 1;
+   I->base = base;
+   I->size = size;
+   I->mapped = mapped;
+   if (check_image(base, size)) {
+      char emsg[512];
+      release_image(I);
+      snprintf(emsg, 512, "Invalid template image %s", filename);
+      set_error_string(W, -1, emsg);
+      return (-1);
+   }
+
+   H = (TmplImageHead_*) base;
+   tr = (TmplImageTemplate_*) (H+1);
+   for (t=0;t<H->ntemplate;t++) {
+      char *name = base + H->pool + tr[t].name;
+      if (!tr[t].plain) continue;
+      tree = new_tree(name);
+      tree->image = I;
+      I->refs++;
+      image_items(tree, I, tree->root, t);
+      install_tree(W, name, tree, NULL, NULL);
+   }
+   release_image(I);
+   return (0);
+}
+
+
+/* ------- Template evaluation routines ----------- */
+
+/* Re-read a slot's file if it has changed.  The file is checked
+   at most every 'reload' seconds.  The new tree is read with a
+   scratch instance, so this instance's macros are left alone.
+   A change to a file it includes counts too.
+   A file that does not parse is ignored; the old template stays.
+   The slot is read under the lock, as another instance may grow
+   the slot list meanwhile. */
+
+static void reload_slot(WebTemplate W, int s)
+{
+   TmplSet S = W->set;
+   TmplSlot sl;
+   WebTemplate R;
+   struct stat st;
+   time_t now = time(NULL);
+   char *name, *path, *cstart, *cend;
+   TmplTree tree;
+   int changed;
+   time_t mtime;
+   long mtime_ns;
+   off_t size;
+   ino_t ino;
+
+   LOCK_SET(S);
+   sl = S->slot[s];
+   if (!sl->path || now-sl->checked < S->reload) {
+      UNLOCK_SET(S);
+      return;
+   }
+   sl->checked = now;
+   name = tpl_strdup(sl->name);
+   path = tpl_strdup(sl->path);
+   cstart = sl->cstart? tpl_strdup(sl->cstart): NULL;
+   cend = sl->cend? tpl_strdup(sl->cend): NULL;
+   mtime = sl->mtime;
+   mtime_ns = sl->mtime_ns;
+   size = sl->size;
+   ino = sl->ino;
+   tree = sl->tree;
+   if (tree) ATOMIC_INC(&tree->refs);
+   UNLOCK_SET(S);
+
+   changed = stat(path, &st)==0 &&
+             (st.st_mtime!=mtime || MTIME_NS(&st)!=mtime_ns ||
+              st.st_size!=size || st.st_ino!=ino ||
+              (tree && includes_changed(tree)));
+   release_tree(tree);
+   if (changed) {
+      ATOMIC_INC(&S->refs);
+      R = new_instance(S);
+      WebTemplate_set_comments(R, cstart, cend);
+      WebTemplate_get_by_name(R, name, path);
+      WebTemplate_free(R);
+   }
+   tpl_free(name);
+   free_source(path, cstart, cend);
+}
+
+/* Find a template by name: "base.dyn.dyn..."
+   Sets the binding it renders with. */
+
+static Template find_template(WebTemplate W, char *name, TmplBind *bp)
+{
+   Template T;
+   TmplBind B;
+   char *d = strchr(name, '.');
+   int s;
+
+   LOCK_SET(W->set);
+   s = find_slot(W->set, name, d? (size_t)(d-name): strlen(name));
+   if (s>=0 && !W->set->slot[s]->tree) s = -1;
+   UNLOCK_SET(W->set);
+   if (s<0) return (NULL);
+   if (W->set->reload) reload_slot(W, s);
+
+   B = bind_slot(W, s, 0);
+   T = B->tree->root;
+   while (T && d) {   /* find dynamic part */
+      name = d+1;
+      d = strchr(name, '.');
+      T = find_dynamic_template(T, name, d? (size_t)(d-name): strlen(name));
+   }
+   *bp = B;
+   return (T);
+}
+
+
+
+static char hex_digits[] = "0123456789ABCDEF";
+
+/* A filter makes at most this many bytes of one */
+#define FILTER_GROWTH 6
+
+/* Values longer than this are measured, not bounded */
+#define FILTER_BOUND 256
+
+/* Apply a filter to 'len' bytes of text.  Copies the result to
+   'out' if it is not null.  Returns the length of the result. */
+
+static size_t filter_text(int f, char *out, char *in, size_t len)
+{
+   unsigned char *s = (unsigned char*) in;
+   unsigned char *end = s + len;
+   size_t n = 0;
+   char r[8];
+   char *p;
+   int l;
+
+   for (; s<end; s++) {
+      p = r;
+      l = 0;
+      switch (f) {
+        case TF_HTML:
+           switch (*s) {
+             case '&': p = "&amp;"; l = 5; break;
+             case '<': p = "&lt;"; l = 4; break;
+             case '>': p = "&gt;"; l = 4; break;
+             case '"': p = "&quot;"; l = 6; break;
+             case '\'': p = "&#39;"; l = 5; break;
+           }
+           break;
+        case TF_URL:   /* all but the unreserved characters */
+           if (!((*s>='a'&&*s<='z') || (*s>='A'&&*s<='Z') || (*s>='0'&&*s<='9') ||
+                 *s=='-' || *s=='.' || *s=='_' || *s=='~')) {
+              r[0] = '%';
+              r[1] = hex_digits[*s>>4];
+              r[2] = hex_digits[*s&15];
+              l = 3;
+           }
+           break;
+        case TF_JS:    /* inside a quoted javascript string */
+           switch (*s) {
+             case '\\':
+             case '"':
+             case '\'': r[0] = '\\'; r[1] = *s; l = 2; break;
+             case '\n': p = "\\n"; l = 2; break;
+             case '\r': p = "\\r"; l = 2; break;
+             case '\t': p = "\\t"; l = 2; break;
+             case 0xe2:  /* utf-8 line and paragraph separators */
+                if (s+2<end && s[1]==0x80 && (s[2]==0xa8||s[2]==0xa9)) {
+                   p = s[2]==0xa8? "\\u2028": "\\u2029";
+                   l = 6;
+                   s += 2;
+                }
+                break;
+             default:
+                if (*s<0x20 || *s=='<' || *s=='>' || *s=='&') {
+                   memcpy(r, "\\u00", 4);
+                   r[4] = hex_digits[*s>>4];
+                   r[5] = hex_digits[*s&15];
+                   l = 6;
+                }
+           }
+           break;
+      }
+      if (l) {
+         if (out) memcpy(out+n, p, l);
+         n += l;
+      } else {
+         if (out) out[n] = *s;
+         n++;
+      }
+   }
+   return (n);
+}
+
+
+
+/* Parse (evaluate) a template.  
+   The size pass, then the copy pass.  Copying takes the
+   dynamic text of the template's blocks, which is then cleared,
+   if 'take'.  A deferred parse used is rendered in place, though
+   one that is filtered is first rendered to its macro.
+   With 'bound' the size may be over: a short filtered value is
+   allowed its most growth, so it is only scanned as it is copied. */
+
+static void render_defer(WebTemplate W, TmplDefer P);
+
+static size_t size_template(WebTemplate W, TmplBind B, Template T, int bound)
+{
+   size_t len = T->slen;
+   TmplItem ti;
+   int v;
+
+   for (v=0; v<T->nvar; v++) {
+      ti = T->item + T->var[v];
+      if (ti->type==TI_MACRO) {
+         TmplMacro m = B->mac[ti->index];
+         if (m->type==TM_TMPL) {
+            if (!ti->filter) {
+               len += size_template(W, &m->defer->bind, m->defer->T, bound);
+               continue;
+            }
+            render_defer(W, m->defer);
+         }
+         if (m->type!=TM_TEXT) format_macro(m);
+         if (!ti->filter || !m->value) len += m->len;
+         else if (bound && m->len<=FILTER_BOUND) len += FILTER_GROWTH*m->len;
+         else len += filter_text(ti->filter, NULL, m->value, m->len);
+      } else {
+         len += B->dyn[ti->index].len;
+      }
+   }
+   return (len);
+}
+
+static char *copy_template(TmplBind B, Template T, char *e, int take)
+{
+   TmplItem ti = T->item;
+   TmplItem te = ti + T->nitem;
+
+   for (;ti<te;ti++) {
+      if (ti->type==TI_TEXT) {
+         memcpy(e, ti->content, ti->len);
+         e += ti->len;
+      } else if (ti->type==TI_MACRO) {
+         TmplMacro m = B->mac[ti->index];
+         if (m->type==TM_TMPL) {
+            e = copy_template(&m->defer->bind, m->defer->T, e, 0);
+         } else if (m->value && ti->filter) {
+            e += filter_text(ti->filter, e, m->value, m->len);
+         } else if (m->value) {
+            memcpy(e, m->value, m->len);
+            e += m->len;
+         }
+      } else {
+         TmplDyn d = B->dyn + ti->index;
+         if (d->len) memcpy(e, d->text, d->len);
+         e += d->len;
+         if (take) d->len = 0;
+      }
+   }
+   return (e);
+}
+
+/* Render a deferred parse to its macro's value, as the parse
+   would have, and drop it. */
+
+static void render_defer(WebTemplate W, TmplDefer P)
+{
+   TmplMacro m = P->m;
+   char *v, *e;
+   int own;
+
+   v = request_alloc(W, size_template(W, &P->bind, P->T, 0)+1, &own);
+   e = copy_template(&P->bind, P->T, v, 1);
+   *e = '\0';
+   free_defer(W, P);
+   set_macro_value_b(m, v, e-v, own);
+}
+
+/* A macro is about to change.  Deferred parses that use it are
+   given its old value, so they show the value they were parsed
+   with.  A deferred parse that is its value is otherwise dropped. */
+
+static void changing(WebTemplate W, TmplMacro m)
+{
+   TmplDefer P;
+   TmplMacro r = NULL;
+   int i;
+
+   for (P=W->defer; P; P=P->next) {
+      if (!template_uses(&P->bind, P->T, m)) continue;
+      if (!r) r = retire_macro(m);
+      for (i=0; P->bind.mac[i]!=m; i++);
+      P->bind.mac[i] = r;
+      r->refs++;
+   }
+   if (m->type==TM_TMPL) free_defer(W, m->defer);
+}
+
+/* Defer a parse into 'm', which must not be used by the template.
+   The template's blocks' dynamic text moves to it, and it keeps
+   the macros it uses. */
+
+static void defer_template(WebTemplate W, TmplMacro m, TmplBind B, Template T)
+{
+   TmplDefer P;
+   TmplTree t = B->tree;
+   TmplItem ti;
+   int v;
+
+   if (W->defer) changing(W, m);
+   P = (TmplDefer) tpl_malloc(sizeof(TmplDefer_));
+   P->m = m;
+   P->T = T;
+   P->bind.tree = t;
+   ATOMIC_INC(&t->refs);
+   P->bind.mac = (TmplMacro*) tpl_malloc((t->nmacro+1)*sizeof(TmplMacro));
+   memcpy(P->bind.mac, B->mac, t->nmacro*sizeof(TmplMacro));
+   P->bind.dyn = (TmplDyn) tpl_malloc((t->ndyn+1)*sizeof(TmplDyn_));
+   memset(P->bind.dyn, '\0', (t->ndyn+1)*sizeof(TmplDyn_));
+   for (v=0; v<T->nvar; v++) {
+      ti = T->item + T->var[v];
+      if (ti->type!=TI_DYNAMIC) continue;
+      P->bind.dyn[ti->index] = B->dyn[ti->index];
+      memset(B->dyn+ti->index, '\0', sizeof(TmplDyn_));
+   }
+   set_macro_value_b(m, NULL, 0, MV_OWN);
+   m->type = TM_TMPL;
+   m->defer = P;
+   P->next = W->defer;
+   W->defer = P;
+}
+
+/* Make room for 'len' more bytes of a block's dynamic text.
+   The space doubles, and is kept for the next rows. */
+
+static void grow_dynamic(WebTemplate W, TmplDyn d, size_t len)
+{
+   size_t size;
+   char *n;
+
+   if (d->len+len+1 <= d->size) return;
+   size = 2 * (d->len+len+1);
+   if (W->arena) {
+      n = (char*) arena_realloc(W->arena, d->own==MV_ARENA? d->text: NULL,
+                                d->len, size);
+      if (d->own!=MV_ARENA) {
+         if (d->len) memcpy(n, d->text, d->len);
+         if (d->text) tpl_free(d->text);
+      }
+      d->own = MV_ARENA;
+   } else {
+      n = (char*) tpl_realloc(d->text, size);
+   }
+   d->text = n;
+   d->size = size;
+}
+
+
+/* Parse a dynamic block 
+   This adds the evaluated template to the block's dynamic text,
+   which is parsed into the parent.  The row is copied straight
+   into that text, whose space is kept, so it need only be bounded. */
+
+/* Pull the rows of a template's blocks that have row sources.
+   Each row is parsed into its block's dynamic text. */
+
+static void parse_dynamic(WebTemplate W, TmplBind B, Template T);
+
+static TmplSource find_source(WebTemplate W, Template T)
+{
+   TmplSource r;
+   for (r=W->source; r && r->T!=T; r=r->next);
+   return (r);
+}
+
+/* Does a block of T stream its rows from a source as T is written? */
+
+static int has_source(WebTemplate W, Template T)
+{
+   TmplItem ti;
+   int v;
+
+   for (v=0; v<T->nvar; v++) {
+      ti = T->item + T->var[v];
+      if (ti->type==TI_DYNAMIC && find_source(W, ti->content)) return (1);
+   }
+   return (0);
+}
+
+static void pull_rows(WebTemplate W, TmplBind B, Template T)
+{
+   TmplSource r;
+   TmplItem ti;
+   int v;
+
+   for (v=0; v<T->nvar; v++) {
+      ti = T->item + T->var[v];
+      if (ti->type!=TI_DYNAMIC || !(r=find_source(W, ti->content))) continue;
+      while (r->fn(W, r->ctx)) parse_dynamic(W, B, ti->content);
+   }
+}
+
+static void parse_dynamic(WebTemplate W, TmplBind B, Template T)
+{
+   TmplDyn d = B->dyn + T->index;
+   if (W->source) pull_rows(W, B, T);
+   grow_dynamic(W, d, size_template(W, B, T, 1));
+   d->len = copy_template(B, T, d->text + d->len, 1) - d->text;
+}
+
+int WebTemplate_parse_dynamic(WebTemplate W, char *dname)
+{
+   Template T;
+   TmplBind B;
+
+   clear_error_string(W);
+   if (!(T=find_template(W, dname, &B)) || !T->parent) {
+      set_error_string(W, 1, "template not found");
+      return (1);
+   }
+   parse_dynamic(W, B, T);
+   return (0);
+}
+
+/* Resolve a dynamic block's name once, for use with
+   WebTemplate_parse_dynamic_h.  The handle belongs to the
+   web template, and is freed with it.  Asking again for the
+   same block gives the same handle. */
+
+TmplDynHandle WebTemplate_dynamic_handle(WebTemplate W, char *dname)
+{
+   Template T;
+   TmplBind B;
+   TmplDynHandle h;
+
+   clear_error_string(W);
+   if (!(T=find_template(W, dname, &B)) || !T->parent) {
+      set_error_string(W, 1, "template not found");
+      return (NULL);
+   }
+   for (h=W->dhandle; h; h=h->next) {
+      if (h->T==T && h->tree==B->tree) return (h);
+   }
+   h = (TmplDynHandle) tpl_malloc(sizeof(TmplDynHandle_));
+   h->slot = B - W->bind;
+   h->tree = B->tree;
+   ATOMIC_INC(&h->tree->refs);
+   h->T = T;
+   h->next = W->dhandle;
+   W->dhandle = h;
+   return (h);
+}
+
+/* Free a dynamic block handle, as one gone stale.  It is the
+   handle of every call that returned it. */
+
+void WebTemplate_free_dynamic_handle(WebTemplate W, TmplDynHandle h)
+{
+   TmplDynHandle *hp;
+
+   clear_error_string(W);
+   for (hp=&W->dhandle; *hp && *hp!=h; hp=&(*hp)->next);
+   if (!*hp) return;
+   *hp = h->next;
+   release_tree(h->tree);
+   tpl_free(h);
+}
+
+/* Parse a dynamic block by handle.  A handle goes stale when its
+   template is reloaded; get a new one. */
+
+int WebTemplate_parse_dynamic_h(WebTemplate W, TmplDynHandle h)
+{
+   TmplBind B;
+
+   clear_error_string(W);
+   if (!h) {
+      set_error_string(W, 1, "template not found");
+      return (1);
+   }
+   if (W->set->reload) reload_slot(W, h->slot);
+   B = bind_slot(W, h->slot, 0);
+   if (B->tree!=h->tree) {
+      set_error_string(W, 1, "template was reloaded");
+      return (1);
+   }
+   parse_dynamic(W, B, h->T);
+   return (0);
+}
+
+/* Parse a dynamic block once per row of a table kept by column:
+   values[c][r] is column c of row r, and lengths[c][r] its length,
+   or it is a string if 'lengths' or lengths[c] is null.  The column
+   macros are found once and each row's values are used in place,
+   not copied.  The column macros are left with no value.  A column
+   with a null name is skipped, and one with null values is empty. */
+
+int WebTemplate_parse_dynamic_rows(WebTemplate W, char *dname, char **columns,
+          int ncols, char ***values, size_t **lengths, int nrows)
+{
+   Template T;
+   TmplBind B;
+   TmplMacro *col, m;
+   int c, r;
+
+   clear_error_string(W);
+   if (!(T=find_template(W, dname, &B)) || !T->parent) {
+      set_error_string(W, 1, "template not found");
+      return (1);
+   }
+   col = (TmplMacro*) tpl_malloc((ncols+1)*sizeof(TmplMacro));
+   for (c=0; c<ncols; c++) {
+      if (!columns[c]) {
+         col[c] = NULL;
+         continue;
+      }
+      col[c] = add_indexed_macro(W->macros, columns[c], NULL);
+      if (W->defer) changing(W, col[c]);
+      set_macro_value_b(col[c], NULL, 0, MV_REF);
+   }
+   for (r=0; r<nrows; r++) {
+      for (c=0; c<ncols; c++) {
+         if (!(m=col[c])) continue;
+         if (!(m->value=values[c]? values[c][r]: NULL)) m->len = 0;
+         else if (lengths && lengths[c]) m->len = lengths[c][r];
+         else m->len = strlen(m->value);
+         if (!m->len) m->value = NULL;
+      }
+      parse_dynamic(W, B, T);
+   }
+   for (c=0; c<ncols; c++)
+      if (col[c]) set_macro_value_b(col[c], NULL, 0, MV_OWN);
+   tpl_free(col);
+   return (0);
+}
+
+/* Give a dynamic block a row source.  Its rows are pulled each
+   time its parent is rendered, and when it is streamed each row is
+   written as it is made, so the table is never held whole.
+   A null 'fn' removes the source. */
+
+int WebTemplate_set_row_source(WebTemplate W, char *dname, TmplRowFn fn, void *ctx)
+{
+   Template T;
+   TmplBind B;
+   TmplSource r, *rp;
+
+   clear_error_string(W);
+   if (!(T=find_template(W, dname, &B)) || !T->parent) {
+      set_error_string(W, 1, "template not found");
+      return (1);
+   }
+   for (rp=&W->source; (r=*rp) && r->T!=T; rp=&r->next);
+   if (!fn) {
+      if (r) {
+         *rp = r->next;
+         release_tree(r->tree);
+         tpl_free(r);
+      }
+      return (0);
+   }
+   if (!r) {
+      r = (TmplSource) tpl_malloc(sizeof(TmplSource_));
+      r->tree = B->tree;
+      ATOMIC_INC(&r->tree->refs);
+      r->T = T;
+      r->next = W->source;
+      W->source = r;
+   }
+   r->fn = fn;
+   r->ctx = ctx;
+   return (0);
+}
+
+/* Parse a plain template 
+   This defines a macro with the evaluated template as its value.
+   A deferred parse is rendered only when the macro is used. */
+
+int WebTemplate_parse(WebTemplate W, char *mname, char *tname)
+{
+   Template T;
+   TmplBind B;
+   TmplMacro m;
+   TmplFrag f = NULL;
+   char *v, *e;
+   int own;
+
+   clear_error_string(W);
+   if (!(T=find_template(W, tname, &B))) {
+      set_error_string(W, 1, "template not found");
+      return (1);
+   }
+   if (W->source) pull_rows(W, B, T);
+   m = add_indexed_macro(W->macros, mname, NULL);
+   if (W->cache) f = cache_find(W->cache, B, T);
+   if (!f && W->deferred && !template_uses(B, T, m)) {
+      defer_template(W, m, B, T);
+      return (0);
+   }
+   if (f) {
+      v = request_alloc(W, f->len+1, &own);
+      memcpy(v, f->text, f->len);
+      e = v + f->len;
+   } else {
+      v = request_alloc(W, size_template(W, B, T, 0)+1, &own);
+      e = copy_template(B, T, v, 1);
+      if (W->cache && W->cache->keyed) cache_add(W->cache, B, T, v, e-v);
+   }
+   *e = '\0';
+   if (W->defer) changing(W, m);
+   set_macro_value_b(m, v, e-v, own);
+   return (0);
+}
+
+/* Have WebTemplate_parse defer its rendering.  A template parsed
+   into a macro is then rendered once, into whatever uses the macro. */
+
+void WebTemplate_set_deferred(WebTemplate W, int on)
+{
+   clear_error_string(W);
+   W->deferred = on;
+}
+
+/* Keep up to 'size' bytes of templates rendered by WebTemplate_parse,
+   by the values of the macros they use.  A parse with the same
+   values copies the kept text.  A zero size turns the cache off. */
+
+void WebTemplate_set_cache(WebTemplate W, size_t size)
+{
+   clear_error_string(W);
+   if (W->cache && size) {
+      W->cache->limit = size;
+      cache_trim(W->cache, 0);
+   } else if (size) W->cache = new_cache(size);
+   else if (W->cache) {
+      free_cache(W->cache);
+      W->cache = NULL;
+   }
+}
+
+/* Count the parses found in the cache, and those that were not */
+
+void WebTemplate_get_cache_stats(WebTemplate W, unsigned long *hits,
+     unsigned long *misses)
+{
+   *hits = W->cache? W->cache->hits: 0;
+   *misses = W->cache? W->cache->misses: 0;
+}
+
+
+
+/* ------------ Form arguments, parameteres, and cookie tools ---- */
+
+
+#define PRINTF if(0)printf
+
+/* De-html an arg string into 'out', which must have
+   room for strlen(s)+1 characters. */
+
+static void html2text_b(char *s, char *out)
+{
+   char *v;
+   long int k;
+   char hex[4];
+
+   v = out;
+   while (s && *s) {
+      switch (*s) {
+        case '+': *v++ = ' ';
+                  s++;
+                  break;
+        case '%': 
+                  if (isxdigit(s[1])&&isxdigit(s[2])) {
+                     hex[0] = *++s;
+                     hex[1] = *++s;
+                     hex[2] = '\0';
+                     k = strtol(hex,0,16);
+                     *v++ = (char)k;
+                     s++;
+                  } else {   // not a hex encoding
+                     *v++ = *s++;
+                  }
+                  break;
+        case 0x0d: s++;  /* cr */
+                  break;
+        default:  *v++ = *s++;
+      }
+   }
+   *v-- = '\0';
+   while ( (v>out) && (*v=='\n'||*v=='\r')) *v-- = '\0';
+}
+
+/* De-html an arg string. Returns a malloc'd string. */
+
+static char *html2text(char *s)
+{
+   char *out;
+
+   if ((!s)||!*s) return (strdup(""));
+   out = (char*) malloc(strlen(s)+1);
+   html2text_b(s, out);
+   return (out);
+}
+
+/* convert special chars to html */
+
+static char *text2html(char *s)
+{
+   char *out;
+   char *v;
    int n;
 
-   for (n=0,v=s; v&&*v; v++) {
-      if ((*v=='"') ||
-          (*v=='<') ||  
-          (*v=='>') ||  
-          (*v=='&')) n++;
+   for (n=0,v=s; v&&*v; v++) {
+      if ((*v=='"') ||
+          (*v=='<') ||  
+          (*v=='>') ||  
+          (*v=='&')) n++;
+   }
+   if (!n) return (strdup(s));  
+  
+   out = (char*) malloc(strlen(s)+(n*6));
+   for (v=out; s&&*s; s++) {
+      switch (*s) {
+         case '"': strcpy(v, "&quot;"); v+=6; break;
+         case '<': strcpy(v, "&lt;"); v+=4; break;
+         case '>': strcpy(v, "&gt;"); v+=4; break;
+         case '&': strcpy(v, "&amp;"); v+=5; break;
+         default: *v++ = *s;
+      }
+   }
+   *v = '\0';
+   return (out);
+}
+
+
+/* parse args and values.  Duplicate names produce multiple values. */
+static void scan_arg(WebTemplate W, char *str)
+{
+   char *a, *v, *t;
+   int own;
+   do {
+      if (a = strchr(str,'&')) *a++ = '\0';
+      if (*str) {
+         if (v=strchr(str,'=')) {
+            *v++ = '\0';
+            t = request_alloc(W, strlen(v)+1, &own);
+            html2text_b(v, t);
+         } else t = request_strdup(W, "", &own);
+         append_macro(W->arg, str, t)->own = own;
+      }
+   } while (str = a);
+}
+
+
+/* parse cookie. Duplicates overwrite old value. */
+static void scan_cookie(WebTemplate W, char *str)
+{
+   char *a, *v;
+   int own;
+   do {
+      while (*str==' ') str++;
+      if (a = strchr(str,';')) *a++ = '\0';
+      if (*str) {
+         if (v=strchr(str,'=')) {
+            *v++ = '\0';
+         } else v = "";
+         v = request_strdup(W, v, &own);
+         add_macro(W->in_cookie, str, v)->own = own;
+      }
+   } while (str = a);
+}
+
+
+/* find a string in some buffer */
+static char *memstr(char *mem, size_t meml, char *str, size_t strl)
+{
+   char *p;
+   for (p=memchr(mem,*str,meml); p;
+       meml-=(p-mem+1),mem=p+1,p=memchr(mem,*str,meml))
+           if (!strncmp(p,str,strl)) return (p);
+   return (NULL);
+}
+
+/* Parse a multipart form.  Duplicate names produce multiple values. */
+
+static void scan_mp_arg(WebTemplate W, char *str, int strl, char *b)
+{
+   char *a, *v, *s, *e;
+   char *n,*eh;
+   char *fn, *ct;
+   size_t l;
+   size_t lb = strlen(b);
+   int octet;
+   int own;
+   char *estr = str + strl;
+
+   for (s=memstr(str,strl,b,lb); s && (e = memstr(s+lb,estr-s-lb,b,lb)); s=e) {
+      s += lb;
+      *e = '\0';
+      if (*s=='\r') s++;
+
+      /* Parse the header. We want the name, filename, and type. */
+      eh = strstr(s,"\r\n\r\n");
+      if (!eh) continue;
+      *eh = '\0';
+      n = strstr(s,"name=\"");
+      if (!n) continue;
+      n += 6;
+      s = strchr(n,'"');
+      if (!s) continue;
+      *s++ = '\0';  /* n is name */
+
+      fn = strstr(s,"filename=\"");
+      if (fn) {
+        fn += 10;
+        s = strchr(fn,'"');
+        if (s) *s++ = '\0';  /* fn is filename */
+        else fn = NULL;
+      }
+
+      /* We'll assume any specified content is 'binary' */
+      if (ct = strstr(s, "Content-Type:")) {
+        octet = 1;
+        ct += 14;
+        s = strchr(ct,'\r');
+        if (s) *s++ = '\0';  /* ct is content-type */
+      } else octet = 0;
+     
+      s = eh+4;
+      l = e - s - 2; /* data followed by \r\n */
+      
+      if (octet) {
+         TmplMacro m;
+         v = request_alloc(W, l, &own);
+         memcpy(v, s, l);
+         m = append_macro_b(W->octet, n, v, l);
+         m->own = own;
+         m->xtra1 = fn? tpl_strdup(fn): NULL;
+         m->xtra2 = tpl_strdup(ct);
+      } else {
+         v = request_alloc(W, l+1, &own); 
+         for (a=v; *s; s++) if (*s!='\r') *a++=*s; /* delete CRs */
+         *a = '\0';
+         append_macro(W->arg, n, v)->own = own;
+      }
+   } 
+}
+
+static char *months[] = {
+ "Jan","Feb","Mar","Apr","May","Jun","Jul","Aug","Sep","Oct","Nov","Dec"};
+static char *wdays[] = {
+ "Sun","Mon","Tue","Wed","Thu","Fri","Sat"};
+
+void WebTemplate_set_cookie(WebTemplate W, char *name, char *argvalue,
+        time_t argexp, char *argdomain, char *argpath, int secure)
+{
+   int l = 0;
+   int own;
+   char *cv;
+   char *v, *p, *d, *s, *e;
+
+   clear_error_string(W);
+   if (!name) return;
+   if (argvalue) {
+      v = argvalue;
+   } else v = "";
+   if (argpath) {
+      p = (char*) tpl_malloc(strlen(argpath)+8);
+      sprintf(p," path=%s;", argpath);
+   } else p = "";
+   if (argdomain) {
+      d = (char*) tpl_malloc(strlen(argdomain)+10);
+      sprintf(d," domain=%s;", argdomain);
+   } else d = "";
+   if (secure) {
+      s = " secure";
+   } else s = "";
+   if (argexp) {
+      struct tm *t;
+      t = gmtime(&argexp);
+      e = (char*) tpl_malloc(48);
+      sprintf(e," expires=%s, %02d-%s-%4d %02d:%02d:%02d GMT;",
+          wdays[t->tm_wday], t->tm_mday, months[t->tm_mon],
+          t->tm_year+1900, t->tm_hour, t->tm_min, t->tm_sec);
+   } else e = "";
+   
+   cv = request_alloc(W, strlen(name) + strlen(s) + 
+        strlen(v) + strlen(p) + strlen(d) + strlen(e) + 16, &own);
+   sprintf(cv, "%s=%s;%s%s%s%s", name, v, e, p, d, s);
+   
+   append_macro(W->header, "Set-Cookie", cv)->own = own;
+   if (argpath) tpl_free(p);
+   if (argdomain) tpl_free(d);
+   if (argexp) tpl_free(e);
+}
+
+
+/* Add a header line */
+void WebTemplate_add_header(WebTemplate W, char *name, char *value)
+{
+   int l = 0;
+   int own;
+   char *v;
+
+   clear_error_string(W);
+   if (!name) return;
+   if (!value) return;
+   v = request_strdup(W, value, &own);
+   append_macro(W->header, name, v)->own = own;
+}
+
+
+/* Load the args and cookies values */
+void WebTemplate_get_args(WebTemplate W)
+{
+   char *env;
+   int n,r;
+   
+   clear_error_string(W);
+   /* release any existing args or in-cookies */
+   free_macros(W->arg->next);
+   W->arg->next = NULL;
+   free_macros(W->in_cookie->next);
+   W->in_cookie->next = NULL;
+
+   env = getenv("REMOTE_USER");
+   if ((env)&&(*env)) {
+      PRINTF("Got User: %s\n", env);
+      remote_user = strdup(env);
+   } else remote_user = NULL;
+     
+     
+   env = getenv("CONTENT_LENGTH");
+   if ((env)&&(*env)) {
+      n = atoi(env);
+      env = getenv("CONTENT_TYPE");
+      if ((env)&&(*env)) {
+         PRINTF("<p>POST data (%d) bytes of %s\n", n, env);
+         if (!strncmp(env,"application/x-www-form-urlencoded",33)) {
+            int nr;
+            env = (char *)tpl_malloc(n+1);
+            for (nr=0;nr<n;nr+=r) {
+              r = read(0,env+nr,n-nr);
+              if (!r) {
+                 if (errno==EAGAIN) SLEEP;
+                 else break;
+              }
+            }
+            if (nr>0) {
+              env[nr] = '\0';
+              scan_arg(W, env);
+            }
+            tpl_free(env);
+         } else if (!strncmp(env,"multipart/form-data",19)) {
+            char *mpb;
+            char *b = strstr(env,"boundary=");
+            if (b) {
+              int nr;
+              mpb = tpl_strdup(b+7);
+              strncpy(mpb,"--",2);  /* boundary actually has 2 extra - */
+              env = (char *)tpl_malloc(n+1);
+              for (nr=0;nr<n;nr+=r) {
+                r = read(0,env+nr,n-nr);
+                if (!r) {
+                   if (errno==EAGAIN) SLEEP;
+                   else break;
+                }
+              }
+              if (nr>0) scan_mp_arg(W, env, n, mpb);
+              tpl_free (env);
+              tpl_free (mpb);
+            }
+         }
+      }
+   }
+
+   env = getenv("QUERY_STRING");
+   if ((env)&&(*env)) {
+      char *e = tpl_strdup(env);
+      PRINTF("Got GET args\n");
+      scan_arg(W, e);
+      tpl_free(e);
+   }
+
+   env = getenv("HTTP_COOKIE");
+   if ((env)&&(*env)) {
+      char *e = tpl_strdup(env);
+      PRINTF("Got cookies args\n");
+      scan_cookie(W, e);
+      tpl_free(e);
+   }
+   
+}
+
+
+/* Return the value of an arg macro.  Caller must free the string.  */
+char *WebTemplate_get_arg(WebTemplate W, char *name)
+{
+   TmplMacro M;
+   clear_error_string(W);
+   M = find_macro(W->arg, name);
+   if (M && M->value) return (strdup(M->value));
+   return (NULL);
+}
+
+/* Return a list of values of an arg macro. */
+char **WebTemplate_get_arg_list(WebTemplate W, char *name)
+{
+   TmplMacro M = W->arg;
+   TmplMacro m;
+   int nv = 0;
+   char **list;
+   char **lp;
+
+   clear_error_string(W);
+   /* count number of matches */
+   for (m=M;m;m=m->next) if (!strcmp(m->name, name)) nv++;
+   if (!nv) return (NULL);
+
+   /* build list */
+   list = (char**) malloc((nv+1)*sizeof(char*));
+   lp = list;
+   for (m=M;m;m=m->next) if (m->value && !strcmp(m->name, name)) {
+      *lp = strdup(m->value);
+      lp++;
+   }
+   *lp = NULL;
+   return (list);
+}
+
+void WebTemplate_free_arg_list(char **list)
+{
+   char **lp;
+   if (!list) return;
+   for (lp=list;*lp;lp++) free(*lp);
+   free(list);
+}
+
+/* Return the n'th arg and value.  Caller must free both strings.  
+    'n' is updated. Note the first arg is void. */
+char *WebTemplate_get_next_arg(WebTemplate W, int *n, char **v)
+{
+   TmplMacro m;
+   int i;
+   clear_error_string(W);
+   for (i=0,m=W->arg;m&&i<=*n;i++,m=m->next);
+   if (m) {
+      if (v) *v = m->value? strdup(m->value): NULL;
+      (*n)++;
+      return (strdup(m->name));
+   }
+   return (NULL);
+}
+
+
+/* Return the value of a cookie macro.  Caller must free the string. */
+char *WebTemplate_get_cookie(WebTemplate W, char *name)
+{
+   TmplMacro M;
+   clear_error_string(W);
+   M = find_macro(W->in_cookie, name);
+   if (M && M->value) return (strdup(M->value));
+   return (NULL);
+}
+
+
+/* Return the value of an octet macro.  Caller must not free the memory.  */
+int WebTemplate_get_octet_arg(WebTemplate W, char *name, 
+     void **value, size_t *len, char **type, char **filename)
+{
+   TmplMacro M;
+   clear_error_string(W);
+   M = find_macro(W->octet, name);
+   if (M && value && len) {
+      *value = (void*) M->value;
+      *len = M->len;
+      if (type) *type = M->xtra2? strdup(M->xtra2): NULL; 
+      if (filename) *filename = M->xtra1? strdup(M->xtra1): NULL; 
+      return (1);
    }
-   if (!n) return (strdup(s));  
-  
-   out = (char*) malloc(strlen(s)+(n*6));
-   for (v=out; s&&*s; s++) {
-      switch (*s) {
-         case '"': strcpy(v, "&quot;"); v+=6; break;
-         case '<': strcpy(v, "&lt;"); v+=4; break;
-         case '>': strcpy(v, "&gt;"); v+=4; break;
-         case '&': strcpy(v, "&amp;"); v+=5; break;
-         default: *v++ = *s;
+   return (0);
+}
+
+
+
+
+/* ----- API to do output -------- */
+
+/* Format the headers plus any cookies, and the blank line, into one
+   string.  'clen' is a body length to send as Content-Length, or
+   NULL.  Returns the string, to be freed, and its length. */
+
+static char html_header[] = "Content-type: text/html; charset=ISO-8859-1\n";
+static char gzip_header[] = "Content-Encoding: gzip\n";
+static char vary_header[] = "Vary: Accept-Encoding\n";
+static char not_modified_header[] = "Status: 304 Not Modified\n";
+
+static char *format_header(WebTemplate W, size_t *clen, size_t *lenp)
+{
+   TmplMacro m;
+   char *buf, *p;
+   size_t n = 2;
+   int ctype = find_macro(W->header, "Content-type")!=NULL;
+
+   if (clen && find_macro(W->header, "Content-Length")) clen = NULL;
+   if (W->out.not_modified) ctype = 1;   /* there is no content */
+   if (!ctype) n += sizeof(html_header);
+   if (clen) n += 40;
+   if (W->out.gzip) n += sizeof(gzip_header);
+   if (W->compress) n += sizeof(vary_header);
+   n += sizeof(not_modified_header) + sizeof(W->out.etag) + 8;
+   for (m=W->header; m; m=m->next) {
+      if (m->value) n += strlen(m->name) + 3 + m->len;
+   }
+   p = buf = (char*) tpl_malloc(n);
+
+   if (W->out.not_modified) {
+      memcpy(p, not_modified_header, sizeof(not_modified_header)-1);
+      p += sizeof(not_modified_header)-1;
+   }
+   if (W->out.etag[0]) p += sprintf(p, "ETag: %s\n", W->out.etag);
+
+   /* Make sure there is a content header */
+   if (!ctype) {
+      memcpy(p, html_header, sizeof(html_header)-1);
+      p += sizeof(html_header)-1;
+   }
+   if (clen) {
+      p += sprintf(p, "Content-Length: %lu\n", (unsigned long)*clen);
+      W->out.sized = 1;
+   }
+   if (W->out.gzip) {
+      memcpy(p, gzip_header, sizeof(gzip_header)-1);
+      p += sizeof(gzip_header)-1;
+   }
+   /* Any response may differ by encoding, even one sent plain */
+   if (W->compress) {
+      memcpy(p, vary_header, sizeof(vary_header)-1);
+      p += sizeof(vary_header)-1;
+   }
+
+   /* Then any extra headers - including cookies. */
+   for (m=W->header; m; m=m->next) {
+      if (!m->value) continue;
+      n = strlen(m->name);
+      memcpy(p, m->name, n);
+      p += n;
+      *p++ = ':';
+      *p++ = ' ';
+      memcpy(p, m->value, m->len);
+      p += m->len;
+      *p++ = '\n';
+   }
+   *p++ = '\n';
+   *lenp = p - buf;
+   return (buf);
+}
+
+/* Write all of some pieces to an fd, in one system call if it
+   will go.  Returns 0, or the errno of a failed write. */
+
+static int write_pieces(int fd, struct iovec *iov, int n)
+{
+   int s;
+
+   while (n) {
+#ifndef WIN32
+      s = writev(fd, iov, n);
+#else
+      s = write(fd, iov->iov_base, (int)iov->iov_len);
+#endif
+      if (s<0 && errno==EINTR) continue;
+      if (s<0) return (errno);
+      for (; n && (size_t)s>=iov->iov_len; n--, iov++) s -= iov->iov_len;
+      if (n) {
+         iov->iov_base = (char*) iov->iov_base + s;
+         iov->iov_len -= s;
       }
    }
-   *v = '\0';
-   return (out);
+   return (0);
 }
 
+/* Output goes to the instance's sink through its buffer.  The sink
+   is the output fd unless the caller gave a function.  The buffer
+   is emptied at the end of each call that writes. */
 
-/* parse args and values.  Duplicate names produce multiple values. */
-static void scan_arg(WebTemplate W, char *str)
+/* Send the buffer, then 'len' bytes at 'p', to the sink.
+   An fd takes both in one write. */
+
+static void out_send(TmplOut O, char *p, size_t len)
 {
-   char *a, *v;
-   do {
-      if (a = strchr(str,'&')) *a++ = '\0';
-      if (*str) {
-         if (v=strchr(str,'=')) {
-            *v++ = '\0';
-            v = html2text(v);
-         } else v = strdup("");
-         append_macro(W->arg, str, v);
+   struct iovec iov[2];
+   int n = 0;
+
+   if (!O->err && O->fn) {
+      if (O->len) O->err = O->fn(O->ctx, O->buf, O->len);
+      if (len && !O->err) O->err = O->fn(O->ctx, p, len);
+   } else if (!O->err) {
+      if (O->len) {
+         iov[n].iov_base = O->buf;
+         iov[n++].iov_len = O->len;
       }
-   } while (str = a);
+      if (len) {
+         iov[n].iov_base = p;
+         iov[n++].iov_len = len;
+      }
+      O->err = write_pieces(O->fd, iov, n);
+   }
+   O->len = 0;
 }
 
+static void out_flush(TmplOut O)
+{
+   out_send(O, NULL, 0);
+}
 
-/* parse cookie. Duplicates overwrite old value. */
-static void scan_cookie(WebTemplate W, char *str)
+/* Add bytes to the output buffer.  Long text bypasses it. */
+
+static void out_raw(TmplOut O, char *p, size_t len)
 {
-   char *a, *v;
+   if (O->len+len > O->size) {
+      if (len >= O->size) {
+         out_send(O, p, len);
+         return;
+      }
+      out_flush(O);
+   }
+   memcpy(O->buf+O->len, p, len);
+   O->len += len;
+}
+
+#ifdef HAVE_LIBZ
+
+/* The gzip stage.  A page's text is deflated as raw blocks, with
+   the gzip header and trailer made here, so that precompressed text
+   can go between the blocks: the stream is fully flushed first, and
+   the text's crc is combined with the member's. */
+
+static unsigned char gzip_head[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+
+/* Compressed bytes go on to the buffer, or are held */
+
+static void gz_raw(TmplOut O, char *p, size_t len)
+{
+   TmplGzip G = O->gz;
+
+   if (!G->held) {
+      out_raw(O, p, len);
+      return;
+   }
+   if (G->hlen+len > G->hsize) {
+      G->hsize = 2*(G->hlen+len);
+      G->hold = (char*) tpl_realloc(G->hold, G->hsize);
+   }
+   memcpy(G->hold+G->hlen, p, len);
+   G->hlen += len;
+}
+
+/* Deflate until the input is taken and, with a flush, all the
+   output is out.  It goes straight into the buffer or hold. */
+
+static void gz_deflate(TmplOut O, int flush)
+{
+   TmplGzip G = O->gz;
+   z_stream *zs = (z_stream*) G->zs;
+   size_t avail;
+
    do {
-      while (*str==' ') str++;
-      if (a = strchr(str,';')) *a++ = '\0';
-      if (*str) {
-         if (v=strchr(str,'=')) {
-            *v++ = '\0';
+      if (G->held) {
+         if (G->hlen==G->hsize) {
+            G->hsize = 2*G->hsize + TPL_OUT_MIN;
+            G->hold = (char*) tpl_realloc(G->hold, G->hsize);
          }
-         add_macro(W->in_cookie, str, strdup(v));
+         zs->next_out = (Bytef*) G->hold + G->hlen;
+         avail = G->hsize - G->hlen;
+      } else {
+         if (O->len==O->size) out_flush(O);
+         zs->next_out = (Bytef*) O->buf + O->len;
+         avail = O->size - O->len;
       }
-   } while (str = a);
+      zs->avail_out = avail;
+      deflate(zs, flush);
+      if (G->held) G->hlen += avail - zs->avail_out;
+      else O->len += avail - zs->avail_out;
+   } while (!zs->avail_out);
 }
 
+/* Open a gzip member.  The deflater is kept, and made again
+   only when the level changes. */
 
-/* find a string in some buffer */
-static char *memstr(char *mem, size_t meml, char *str, size_t strl)
+static void gz_begin(TmplOut O, int held)
 {
-   char *p;
-   for (p=memchr(mem,*str,meml); p;
-       meml-=(p-mem+1),mem=p+1,p=memchr(mem,*str,meml))
-           if (!strncmp(p,str,strl)) return (p);
-   return (NULL);
+   TmplGzip G = O->gz;
+   z_stream *zs;
+
+   if (!G) {
+      G = O->gz = (TmplGzip) tpl_malloc(sizeof(TmplGzip_));
+      memset(G, '\0', sizeof(TmplGzip_));
+      zs = (z_stream*) tpl_malloc(sizeof(z_stream));
+      memset(zs, '\0', sizeof(z_stream));
+      zs->zalloc = gz_alloc;
+      zs->zfree = gz_free;
+      G->zs = zs;
+   }
+   zs = (z_stream*) G->zs;
+   if (G->level!=O->gzip) {
+      if (G->level) deflateEnd(zs);
+      G->level = 0;
+      if (deflateInit2(zs, O->gzip, Z_DEFLATED, -15, 8,
+                       Z_DEFAULT_STRATEGY)!=Z_OK) {
+         O->err = ENOMEM;
+         O->gzip = 0;
+         return;
+      }
+      G->level = O->gzip;
+   } else deflateReset(zs);
+   G->on = 1;
+   G->held = held;
+   G->hlen = 0;
+   G->crc = crc32(0, NULL, 0);
+   G->total = 0;
+   G->dirty = 0;
+   gz_raw(O, (char*) gzip_head, sizeof(gzip_head));
 }
 
-/* Parse a multipart form.  Duplicate names produce multiple values. */
+static void gz_open(TmplOut O)
+{
+   if (!O->gz || !O->gz->on) gz_begin(O, 0);
+}
 
-static void scan_mp_arg(WebTemplate W, char *str, int strl, char *b)
+static void gz_put(TmplOut O, char *p, size_t len)
 {
-   char *a, *v, *s, *e;
-   char *n,*eh;
-   char *fn, *ct;
-   size_t l;
-   size_t lb = strlen(b);
-   int octet;
-   char *estr = str + strl;
+   TmplGzip G = O->gz;
+   z_stream *zs = (z_stream*) G->zs;
+
+   if (!len) return;
+   G->crc = crc32(G->crc, (Bytef*) p, len);
+   G->total += len;
+   G->dirty = 1;
+   zs->next_in = (Bytef*) p;
+   zs->avail_in = len;
+   gz_deflate(O, Z_NO_FLUSH);
+}
 
-   for (s=memstr(str,strl,b,lb); s && (e = memstr(s+lb,estr-s-lb,b,lb)); s=e) {
-      s += lb;
-      *e = '\0';
-      if (*s=='\r') s++;
+/* Put a precompressed text item of 'len' bytes in the member */
 
-      /* Parse the header. We want the name, filename, and type. */
-      eh = strstr(s,"\r\n\r\n");
-      if (!eh) continue;
-      *eh = '\0';
-      n = strstr(s,"name=\"");
-      if (!n) continue;
-      n += 6;
-      s = strchr(n,'"');
-      if (!s) continue;
-      *s++ = '\0';  /* n is name */
+static void gz_text(TmplOut O, TmplZText z, size_t len)
+{
+   TmplGzip G = O->gz;
 
-      fn = strstr(s,"filename=\"");
-      if (fn) {
-        fn += 10;
-        s = strchr(fn,'"');
-        if (s) *s++ = '\0';  /* fn is filename */
-        else fn = NULL;
+   if (G->dirty) {
+      ((z_stream*) G->zs)->avail_in = 0;
+      gz_deflate(O, Z_FULL_FLUSH);
+      G->dirty = 0;
+   }
+   gz_raw(O, z->data, z->len);
+   G->crc = crc32_combine(G->crc, z->crc, len);
+   G->total += len;
+}
+
+/* Close the member: the last block, then the trailer.  A held
+   member goes out now, after the headers that give its length.
+   A page is one member, however many calls wrote it. */
+
+static void gz_end(WebTemplate W)
+{
+   TmplOut O = &W->out;
+   TmplGzip G = O->gz;
+   unsigned char t[8];
+   char *hdr;
+   size_t hlen;
+   int i;
+
+   ((z_stream*) G->zs)->avail_in = 0;
+   gz_deflate(O, Z_FINISH);
+   for (i=0; i<4; i++) {
+      t[i] = (G->crc >> 8*i) & 0xff;
+      t[4+i] = (G->total >> 8*i) & 0xff;
+   }
+   gz_raw(O, (char*) t, 8);
+   G->on = 0;
+   if (G->held) {
+      G->held = 0;
+      hdr = format_header(W, &G->hlen, &hlen);
+      O->etag[0] = '\0';
+      out_raw(O, hdr, hlen);
+      tpl_free(hdr);
+      out_send(O, G->hold, G->hlen);
+   }
+}
+
+/* Does the client take gzip?  HTTP_ACCEPT_ENCODING is read as
+   WebTemplate_get_args reads the CGI environment.  A q of zero
+   refuses it. */
+
+static int same_token(char *s, size_t n, char *t)
+{
+   if (strlen(t)!=n) return (0);
+   for (; n; n--,s++,t++) if (tolower((unsigned char)*s)!=*t) return (0);
+   return (1);
+}
+
+static int accepts_gzip()
+{
+   char *e = getenv("HTTP_ACCEPT_ENCODING");
+   char *p;
+   size_t n;
+
+   while (e && *e) {
+      e += strspn(e, " \t,");
+      n = strcspn(e, " \t,;");
+      if (same_token(e, n, "gzip") || same_token(e, n, "x-gzip")) {
+         for (p=e+n; *p==' ' || *p=='\t'; p++);
+         if (*p!=';') return (1);
+         for (p++; *p==' ' || *p=='\t'; p++);
+         if ((*p=='q' || *p=='Q') && p[1]=='=') return (atof(p+2) > 0);
+         return (1);
       }
+      e += strcspn(e, ",");
+   }
+   return (0);
+}
+#endif
 
-      /* We'll assume any specified content is 'binary' */
-      if (ct = strstr(s, "Content-Type:")) {
-        octet = 1;
-        ct += 14;
-        s = strchr(ct,'\r');
-        if (s) *s++ = '\0';  /* ct is content-type */
-      } else octet = 0;
-     
-      s = eh+4;
-      l = e - s - 2; /* data followed by \r\n */
-      
-      if (octet) {
-         TmplMacro m;
-         v = (char*) malloc(l);
-         memcpy(v, s, l);
-         m = append_macro_b(W->octet, n, v, l);
-         m->xtra1 = strdup(fn);
-         m->xtra2 = strdup(ct);
+/* Page ETags.  A page is hashed before its headers go, as they
+   come first.  A client with a matching If-None-Match gets the
+   headers with a 304 status, and no page. */
+
+/* Hash a template's items as out_template would write them */
+
+static void hash_template(WebTemplate W, TmplHash H, TmplBind B, Template T)
+{
+   TmplItem ti = T->item;
+   TmplItem te = ti + T->nitem;
+   char tmp[1024];
+   size_t n;
+
+   for (;ti<te;ti++) {
+      if (ti->type==TI_TEXT) {
+         hash_update(H, (char*) ti->content, ti->len);
+      } else if (ti->type==TI_MACRO) {
+         TmplMacro m = B->mac[ti->index];
+         char *s;
+         if (m->type==TM_TMPL) {
+            if (!ti->filter) {
+               hash_template(W, H, &m->defer->bind, m->defer->T);
+               continue;
+            }
+            render_defer(W, m->defer);
+         }
+         if (m->type!=TM_TEXT) format_macro(m);
+         if (!m->value) continue;
+         if (!ti->filter) {
+            hash_update(H, m->value, m->len);
+            continue;
+         }
+         for (s=m->value; s<m->value+m->len; s+=n) {
+            n = m->value + m->len - s;
+            if (n > sizeof(tmp)/FILTER_GROWTH) {
+               n = sizeof(tmp)/FILTER_GROWTH;
+               if ((unsigned char)s[n-1]==0xe2) n--;
+               else if ((unsigned char)s[n-2]==0xe2) n -= 2;
+            }
+            hash_update(H, tmp, filter_text(ti->filter, tmp, s, n));
+         }
       } else {
-         v = (char*) malloc(l+1); 
-         for (a=v; *s; s++) if (*s!='\r') *a++=*s; /* delete CRs */
-         *a = '\0';
-         append_macro(W->arg, n, v);
+         TmplDyn d = B->dyn + ti->index;
+         hash_update(H, d->text, d->len);
       }
-   } 
+   }
 }
 
-static char *months[] = {
- "Jan","Feb","Mar","Apr","May","Jun","Jul","Aug","Sep","Oct","Nov","Dec"};
-static char *wdays[] = {
- "Sun","Mon","Tue","Wed","Thu","Fri","Sat"};
+/* Note the page's tag, for its headers */
 
-void WebTemplate_set_cookie(WebTemplate W, char *name, char *argvalue,
-        time_t argexp, char *argdomain, char *argpath, int secure)
+static void set_etag(WebTemplate W, TmplHash H)
 {
-   int l = 0;
-   char *cv;
-   char *v, *p, *d, *s, *e;
+   sprintf(W->out.etag, "\"%016llx\"", hash_final(H));
+}
 
-   clear_error_string(W);
-   if (!name) return;
-   if (argvalue) {
-      v = argvalue;
-   } else v = "";
-   if (argpath) {
-      p = (char*) malloc(strlen(argpath)+8);
-      sprintf(p," path=%s;", argpath);
-   } else p = "";
-   if (argdomain) {
-      d = (char*) malloc(strlen(argdomain)+10);
-      sprintf(d," domain=%s;", argdomain);
-   } else d = "";
-   if (secure) {
-      s = " secure";
-   } else s = "";
-   if (argexp) {
-      struct tm *t;
-      t = gmtime(&argexp);
-      e = (char*) malloc(48);
-      sprintf(e," expires=%s, %02d-%s-%4d %02d:%02d:%02d GMT;",
-          wdays[t->tm_wday], t->tm_mday, months[t->tm_mon],
-          t->tm_year+1900, t->tm_hour, t->tm_min, t->tm_sec);
-   } else e = "";
-   
-   cv = (char*) malloc(strlen(name) + strlen(s) + 
-        strlen(v) + strlen(p) + strlen(d) + strlen(e) + 16);
-   sprintf(cv, "%s=%s;%s%s%s%s", name, v, e, p, d, s);
-   
-   append_macro(W->header, "Set-Cookie", cv);
-   if (argpath) free(p);
-   if (argdomain) free(d);
-   if (argexp) free(e);
+static int etag_matches(char *tag)
+{
+   char *e = getenv("HTTP_IF_NONE_MATCH");
+   size_t n, tn = strlen(tag);
+
+   while (e && *e) {
+      e += strspn(e, " \t,");
+      if (*e=='*') return (1);
+      if (e[0]=='W' && e[1]=='/') e += 2;
+      n = strcspn(e, " \t,");
+      if (n==tn && !strncmp(e, tag, n)) return (1);
+      e += n;
+   }
+   return (0);
+}
+
+/* Add bytes to the output, through the gzip stage if the page
+   is gzipped. */
+
+static void out_put(TmplOut O, char *p, size_t len)
+{
+#ifdef HAVE_LIBZ
+   if (O->gzip) {
+      gz_open(O);
+      gz_put(O, p, len);
+      return;
+   }
+#endif
+   out_raw(O, p, len);
+}
+
+/* Filter a macro value into the output buffer, a piece at a time.
+   A piece does not end inside a utf-8
+   separator, which the js filter escapes whole.  A gzipped page
+   filters through a small buffer. */
+
+static void out_filter(TmplOut O, int f, char *s, size_t len)
+{
+   char tmp[1024];
+   unsigned char *u;
+   size_t n;
+
+   while (len) {
+      if (O->gzip) n = sizeof(tmp) / FILTER_GROWTH;
+      else {
+         if (O->size-O->len < 64) out_flush(O);
+         n = (O->size-O->len) / FILTER_GROWTH;
+      }
+      if (n >= len) n = len;
+      else {
+         u = (unsigned char*) s + n;
+         if (u[-1]==0xe2) n--;
+         else if (u[-2]==0xe2) n -= 2;
+      }
+      if (O->gzip) out_put(O, tmp, filter_text(f, tmp, s, n));
+      else O->len += filter_text(f, O->buf+O->len, s, n);
+      s += n;
+      len -= n;
+   }
 }
 
+/* Start and end a call that writes.  Ending sends what is
+   buffered, with a gzipped page flushed to a byte so far, and
+   returns 0 or the error of the sink.  A held page waits. */
 
-/* Add a header line */
-void WebTemplate_add_header(WebTemplate W, char *name, char *value)
+static TmplOut out_begin(WebTemplate W)
 {
-   int l = 0;
+   if (!W->out.buf) W->out.buf = (char*) tpl_malloc(W->out.size);
+   W->out.err = 0;
+   return (&W->out);
+}
 
-   clear_error_string(W);
-   if (!name) return;
-   if (!value) return;
-   append_macro(W->header, name, strdup(value));
+static int out_end(WebTemplate W)
+{
+#ifdef HAVE_LIBZ
+   TmplGzip G = W->out.gz;
+   if (G && G->on && !G->held && G->dirty) {
+      ((z_stream*) G->zs)->avail_in = 0;
+      gz_deflate(&W->out, Z_SYNC_FLUSH);
+   }
+#endif
+   out_flush(&W->out);
+   if (W->out.err) set_error_string(W, W->out.err, NULL);
+   return (W->out.err);
 }
 
+/* Finish the page: close its gzip member, which sends a held page
+   and its headers, then send what is buffered. */
 
-/* Load the args and cookies values */
-void WebTemplate_get_args(WebTemplate W)
+static int out_finish(WebTemplate W)
 {
-   char *env;
-   int n,r;
-   
-   clear_error_string(W);
-   /* release any existing args or in-cookies */
-   free_macros(W->arg->next);
-   W->arg->next = NULL;
-   free_macros(W->in_cookie->next);
-   W->in_cookie->next = NULL;
+   out_begin(W);
+#ifdef HAVE_LIBZ
+   if (W->out.gz && W->out.gz->on) gz_end(W);
+#endif
+   return (out_end(W));
+}
 
-   env = getenv("REMOTE_USER");
-   if ((env)&&(*env)) {
-      PRINTF("Got User: %s\n", env);
-      remote_user = strdup(env);
-   } else remote_user = NULL;
-     
-     
-   env = getenv("CONTENT_LENGTH");
-   if ((env)&&(*env)) {
-      n = atoi(env);
-      env = getenv("CONTENT_TYPE");
-      if ((env)&&(*env)) {
-         PRINTF("<p>POST data (%d) bytes of %s\n", n, env);
-         if (!strncmp(env,"application/x-www-form-urlencoded",33)) {
-            int nr;
-            env = (char *)malloc(n+1);
-            for (nr=0;nr<n;nr+=r) {
-              r = read(0,env+nr,n-nr);
-              if (!r) {
-                 if (errno==EAGAIN) SLEEP;
-                 else break;
-              }
-            }
-            if (nr>0) {
-              env[nr] = '\0';
-              scan_arg(W, env);
-            }
-            free(env);
-         } else if (!strncmp(env,"multipart/form-data",19)) {
-            char *mpb;
-            char *b = strstr(env,"boundary=");
-            if (b) {
-              int nr;
-              mpb = strdup(b+7);
-              strncpy(mpb,"--",2);  /* boundary actually has 2 extra - */
-              env = (char *)malloc(n+1);
-              for (nr=0;nr<n;nr+=r) {
-                r = read(0,env+nr,n-nr);
-                if (!r) {
-                   if (errno==EAGAIN) SLEEP;
-                   else break;
-                }
-              }
-              if (nr>0) scan_mp_arg(W, env, n, mpb);
-              free (env);
-            }
-         }
-      }
-   }
+/* Buffer the headers, if they have not been sent.  'clen' is
+   the length of the page, if it is to be sent.  A gzipped page
+   with a length is held, and its headers sent with it.
+   Returns 1 if the client has the page, which is not to be sent. */
 
-   env = getenv("QUERY_STRING");
-   if ((env)&&(*env)) {
-      char *e = strdup(env);
-      PRINTF("Got GET args\n");
-      scan_arg(W, e);
-      free(e);
-   }
+static int out_header(WebTemplate W, size_t *clen)
+{
+   TmplOut O = &W->out;
+   size_t hlen;
+   char *hdr;
 
-   env = getenv("HTTP_COOKIE");
-   if ((env)&&(*env)) {
-      char *e = strdup(env);
-      PRINTF("Got cookies args\n");
-      scan_cookie(W, e);
-      free(e);
+   if (W->header_sent) return (0);
+   W->header_sent = 1;
+#ifdef HAVE_LIBZ
+   if (W->compress && !find_macro(W->header, "Content-Encoding")
+       && accepts_gzip()) O->gzip = W->compress;
+#endif
+   if (O->etag[0]) {
+      if (O->gzip) strcpy(O->etag+strlen(O->etag)-1, "-gz\"");
+      if (etag_matches(O->etag)) {
+         O->gzip = 0;
+         O->not_modified = 1;
+         clen = NULL;
+      }
    }
-   
+#ifdef HAVE_LIBZ
+   if (O->gzip && clen && W->content_length) {
+      gz_begin(O, 1);
+      return (0);
+   }
+#endif
+   hdr = format_header(W, W->content_length? clen: NULL, &hlen);
+   O->etag[0] = '\0';
+   out_raw(O, hdr, hlen);
+   tpl_free(hdr);
+   return (O->not_modified);
 }
 
+/* Write the html header plus any cookies */
 
-/* Return the value of an arg macro.  Caller must free the string.  */
-char *WebTemplate_get_arg(WebTemplate W, char *name)
+int WebTemplate_header(WebTemplate W)
 {
-   TmplMacro M;
    clear_error_string(W);
-   M = find_macro(W->arg, name);
-   if (M && M->value) return (strdup(M->value));
-   return (NULL);
+   if (W->header_sent) return (0);
+   out_begin(W);
+   out_header(W, NULL);
+   return (out_end(W));
 }
 
-/* Return a list of values of an arg macro. */
-char **WebTemplate_get_arg_list(WebTemplate W, char *name)
-{
-   TmplMacro M = W->arg;
-   TmplMacro m;
-   int nv = 0;
-   char **list;
-   char **lp;
+/* Have the headers give the length of the page written,
+   so the connection can be kept open. */
 
+void WebTemplate_set_content_length(WebTemplate W, int on)
+{
    clear_error_string(W);
-   /* count number of matches */
-   for (m=M;m;m=m->next) if (!strcmp(m->name, name)) nv++;
-   if (!nv) return (NULL);
-
-   /* build list */
-   list = (char**) malloc((nv+1)*sizeof(char*));
-   lp = list;
-   for (m=M;m;m=m->next) if (m->value && !strcmp(m->name, name)) {
-      *lp = strdup(m->value);
-      lp++;
-   }
-   *lp = NULL;
-   return (list);
+   W->content_length = on;
 }
 
-void WebTemplate_free_arg_list(char **list)
+/* Gzip pages for clients that take it, at 'level': 1 to 9, or -1
+   for zlib's default.  Zero turns it off.  Returns 1 if the library
+   was built without zlib. */
+
+int WebTemplate_set_compression(WebTemplate W, int level)
 {
-   char **lp;
-   if (!list) return;
-   for (lp=list;*lp;lp++) free(*lp);
-   free(list);
+   clear_error_string(W);
+#ifdef HAVE_LIBZ
+   W->compress = level>9? 9: level<-1? -1: level;
+   return (0);
+#else
+   if (!level) return (0);
+   set_error_string(W, 1, "compression not available");
+   return (1);
+#endif
 }
 
-/* Return the n'th arg and value.  Caller must free both strings.  
-    'n' is updated. Note the first arg is void. */
-char *WebTemplate_get_next_arg(WebTemplate W, int *n, char **v)
+/* Send an ETag, a hash of the page, with its headers.  A client
+   that has the page, by If-None-Match, is sent a 304 instead.
+   Headers sent by WebTemplate_header, before the page, have none. */
+
+void WebTemplate_set_etag(WebTemplate W, int on)
 {
-   TmplMacro m;
-   int i;
    clear_error_string(W);
-   for (i=0,m=W->arg;m&&i<=*n;i++,m=m->next);
-   if (m) {
-      if (v) *v = m->value? strdup(m->value): NULL;
-      (*n)++;
-      return (strdup(m->name));
-   }
-   return (NULL);
+   W->etag = on;
 }
 
+/* Gzip the text of templates loaded from now on, once.  A gzipped
+   page then has only its macros and blocks compressed. */
 
-/* Return the value of a cookie macro.  Caller must free the string. */
-char *WebTemplate_get_cookie(WebTemplate W, char *name)
+void WebTemplate_set_precompress(WebTemplate W, int on)
 {
-   TmplMacro M;
    clear_error_string(W);
-   M = find_macro(W->in_cookie, name);
-   if (M && M->value) return (strdup(M->value));
-   return (NULL);
+   W->set->precompress = on;
 }
 
 
-/* Return the value of an octet macro.  Caller must not free the memory.  */
-int WebTemplate_get_octet_arg(WebTemplate W, char *name, 
-     void **value, size_t *len, char **type, char **filename)
+/* Write a template's items as copy_template would copy them. */
+
+static void out_template(WebTemplate W, TmplBind B, Template T, int take)
 {
-   TmplMacro M;
-   clear_error_string(W);
-   M = find_macro(W->octet, name);
-   if (M && value && len) {
-      *value = (void*) M->value;
-      *len = M->len;
-      if (type) *type = strdup(M->xtra2); 
-      if (filename) *filename = strdup(M->xtra1); 
-      return (1);
+   TmplOut O = &W->out;
+   TmplItem ti = T->item;
+   TmplItem te = ti + T->nitem;
+
+   for (;ti<te && !O->err;ti++) {
+      if (ti->type==TI_TEXT) {
+#ifdef HAVE_LIBZ
+         if (O->gzip && T->ztext && T->ztext[ti-T->item].data) {
+            gz_open(O);
+            gz_text(O, T->ztext + (ti-T->item), ti->len);
+            continue;
+         }
+#endif
+         out_put(O, (char*) ti->content, ti->len);
+      } else if (ti->type==TI_MACRO) {
+         TmplMacro m = B->mac[ti->index];
+         if (m->type==TM_TMPL) {
+            if (!ti->filter) {
+               out_template(W, &m->defer->bind, m->defer->T, 0);
+               continue;
+            }
+            render_defer(W, m->defer);
+         }
+         if (m->type!=TM_TEXT) format_macro(m);
+         if (m->value && ti->filter) out_filter(O, ti->filter, m->value, m->len);
+         else if (m->value) out_put(O, m->value, m->len);
+      } else {
+         TmplDyn d = B->dyn + ti->index;
+         TmplSource r;
+         if (d->len) out_put(O, d->text, d->len);
+         if (!take) continue;
+         d->len = 0;
+         if (W->source && (r=find_source(W, ti->content))) {
+            while (!O->err && r->fn(W, r->ctx))
+               out_template(W, B, ti->content, 1);
+         }
+      }
    }
-   return (0);
 }
 
+/* A page sent with a Content-Length takes no more writes.
+   Returns 1, with the error set, if it was. */
 
+static int out_sized(WebTemplate W)
+{
+   if (!W->out.sized) return (0);
+   set_error_string(W, 1, "page length already sent");
+   return (1);
+}
 
+/* Write a macro value.  Headers not yet sent go with it,
+   in one write. */
 
-/* ----- API to do output -------- */
+int WebTemplate_write(WebTemplate W, char *name)
+{
+   TmplMacro m = find_indexed_macro(W->macros, name);
+   TmplOut O;
+   TmplHash_ H;
+   int s;
 
-/* Write the html header plus any cookies */
+   clear_error_string(W);
+   if (W->out.not_modified) return (0);
+   if (out_sized(W)) return (1);
+   O = out_begin(W);
+   if (m && m->type==TM_TMPL) {   /* render it as it is written */
+      TmplDefer P = m->defer;
+      size_t len = 0;
+      if (!W->header_sent && W->content_length)
+         len = size_template(W, &P->bind, P->T, 0);
+      if (!W->header_sent && W->etag) {
+         hash_init(&H);
+         hash_template(W, &H, &P->bind, P->T);
+         set_etag(W, &H);
+      }
+      if (!out_header(W, &len)) out_template(W, &P->bind, P->T, 0);
+      return (out_end(W));
+   }
+   if (m) format_macro(m);
+   if (m && m->value) {
+      if (!W->header_sent && W->etag) {
+         hash_init(&H);
+         hash_update(&H, m->value, m->len);
+         set_etag(W, &H);
+      }
+      if (!out_header(W, &m->len)) out_put(O, m->value, m->len);
+   } else out_header(W, NULL);
+   if ((s=out_end(W))) return (s);
+   if (!m || !m->value) return (-1);
+   return (0);
+}
 
-static char html_header[] = "Content-type: text/html; charset=ISO-8859-1\n";
+/* Write a template as it is parsed, without making it a macro.
+   Output goes through the buffer, so a large page is never
+   held whole.  Any headers go in the first write.  A page whose
+   rows stream from a source is not sized for a Content-Length,
+   nor hashed for an ETag, as its rows are not yet made. */
 
-int WebTemplate_header(WebTemplate W)
+int WebTemplate_write_template(WebTemplate W, char *tname)
 {
-   TmplMacro m;
-   char *buf;
-   size_t l, lbuf;
+   Template T;
+   TmplBind B;
+   TmplItem ti;
+   TmplHash_ H;
+   size_t len = 0;
+   int v, streamed;
 
    clear_error_string(W);
-   if (W->header_sent) return (0);
-   buf = (char*) malloc(256);
-   lbuf = 256;
+   if (!(T=find_template(W, tname, &B))) {
+      set_error_string(W, 1, "template not found");
+      return (1);
+   }
+   if (W->out.not_modified) return (0);
+   if (out_sized(W)) return (1);
+   out_begin(W);
+   streamed = W->source && has_source(W, T);
+   if (!W->header_sent && !streamed) {
+      if (W->content_length) len = size_template(W, B, T, 0);
+      if (W->etag) {
+         hash_init(&H);
+         hash_template(W, &H, B, T);
+         set_etag(W, &H);
+      }
+   }
+   if (!out_header(W, streamed? NULL: &len)) out_template(W, B, T, 1);
+   else for (v=0; v<T->nvar; v++) {   /* its rows are used, as if sent */
+      ti = T->item + T->var[v];
+      if (ti->type==TI_DYNAMIC) B->dyn[ti->index].len = 0;
+   }
+   return (out_end(W));
+}
 
-   /* Make sure there is a content header */
-   m = find_macro(W->header, "Content-type");
-   if (!m) write(W->fd, html_header, (int)strlen(html_header));
+/* Render a template to pieces: its text, macro values and dynamic
+   text, each where it is.  Only filtered values are copied.
+   The first pass counts the pieces and the filtered text. */
 
-   /* Write any extra headers - including cookies. */
-   for (m=W->header; m; m=m->next) {
-      if (!m->value) continue;
-      l = strlen(m->name) + 3 + m->len;
-      if ((l+1)>lbuf) {
-         buf = (char*) realloc(buf, (l+1));
-         lbuf = (l+1);
+static int iov_size(WebTemplate W, TmplBind B, Template T, size_t *tlen)
+{
+   TmplItem ti = T->item;
+   TmplItem te = ti + T->nitem;
+   TmplMacro m;
+   int n = 0;
+
+   for (;ti<te;ti++,n++) {
+      if (ti->type!=TI_MACRO) continue;
+      m = B->mac[ti->index];
+      if (m->type==TM_TMPL) {
+         if (!ti->filter) {
+            n += iov_size(W, &m->defer->bind, m->defer->T, tlen) - 1;
+            continue;
+         }
+         render_defer(W, m->defer);
       }
-      sprintf(buf,"%s: %s\n", m->name, m->value);
-      write(W->fd, buf, (int)l);
+      if (m->type!=TM_TEXT) format_macro(m);
+      if (ti->filter && m->value)
+         *tlen += filter_text(ti->filter, NULL, m->value, m->len);
    }
-   free (buf);
-   write(W->fd,"\n",1);
+   return (n);
+}
 
-   W->header_sent = 1;
-   return (0);
+/* Add a piece, joining it to the last one if they touch */
+
+static void iov_add(TmplIov I, char *p, size_t len)
+{
+   struct iovec *v = I->iov + I->n;
+
+   if (!len) return;
+   if (I->n && (char*) v[-1].iov_base + v[-1].iov_len == p) {
+      v[-1].iov_len += len;
+      return;
+   }
+   v->iov_base = p;
+   v->iov_len = len;
+   I->n++;
 }
 
+static void iov_template(TmplIov I, TmplBind B, Template T, int take)
+{
+   TmplItem ti = T->item;
+   TmplItem te = ti + T->nitem;
+   size_t len;
 
+   for (;ti<te;ti++) {
+      if (ti->type==TI_TEXT) {
+         iov_add(I, (char*) ti->content, ti->len);
+      } else if (ti->type==TI_MACRO) {
+         TmplMacro m = B->mac[ti->index];
+         if (m->type==TM_TMPL) {
+            iov_template(I, &m->defer->bind, m->defer->T, 0);
+         } else if (m->value && ti->filter) {
+            len = filter_text(ti->filter, I->text+I->len, m->value, m->len);
+            iov_add(I, I->text+I->len, len);
+            I->len += len;
+         } else if (m->value) {
+            iov_add(I, m->value, m->len);
+         }
+      } else {
+         TmplDyn d = B->dyn + ti->index;
+         iov_add(I, d->text, d->len);
+         if (take) d->len = 0;
+      }
+   }
+}
 
-/* Write a macro value */
+/* Render a template as a list of pieces, in output order, without
+   copying it.  The pieces point into the templates, the macro values
+   and the dynamic text, and are good until the instance is next
+   changed.  The template's dynamic blocks are consumed, as by a parse.
+   A template with a block whose rows stream from a source is refused,
+   as its pieces would have to hold every row. */
 
-int WebTemplate_write(WebTemplate W, char *name)
+int WebTemplate_render_iov(WebTemplate W, char *tname, struct iovec **iov, int *n)
 {
-   TmplMacro m = find_macro(W->macros, name);
-   int s;
+   TmplIov I = &W->iov;
+   Template T;
+   TmplBind B;
+   size_t tlen = 0;
+   int size;
 
    clear_error_string(W);
-   if (!W->header_sent) WebTemplate_header(W);
-   if (!m || !m->value) return (-1);
-   s = write(W->fd, m->value, (int)m->len);
-   if (s!=m->len) {
-      set_error_string(W, errno, NULL);
-      return (errno);
+   if (!(T=find_template(W, tname, &B))) {
+      set_error_string(W, 1, "template not found");
+      return (1);
+   }
+   if (W->source && has_source(W, T)) {
+      set_error_string(W, 1, "template has a row source");
+      return (1);
    }
+   size = iov_size(W, B, T, &tlen);
+   if (size > I->size) {
+      I->iov = (struct iovec*) tpl_realloc(I->iov, size*sizeof(struct iovec));
+      I->size = size;
+   }
+   if (tlen > I->tsize) {
+      if (I->text) tpl_free(I->text);
+      I->text = (char*) tpl_malloc(tlen);
+      I->tsize = tlen;
+   }
+   I->n = 0;
+   I->len = 0;
+   iov_template(I, B, T, 1);
+   *iov = I->iov;
+   *n = I->n;
    return (0);
 }
-  
+
+
+/* Finish the page written.  A gzipped page is closed, and a held
+   one is sent with its headers.  Returns 0 or the sink's error. */
+
+int WebTemplate_finish_output(WebTemplate W)
+{
+   clear_error_string(W);
+   if (!W->out.buf) return (0);
+   return (out_finish(W));
+}
 
 /* Reset the output functions.  For persistant cgi
-   this allows a clean, new page. */
+   this allows a clean, new page.  The page written is finished. */
 
 void WebTemplate_reset_output(WebTemplate W)
 {
    clear_error_string(W);
+   if (W->out.buf) out_finish(W);
    free_macros(W->header->next);
    W->header->next = NULL;
    W->header_sent = 0;
+   W->out.gzip = 0;
+   W->out.not_modified = 0;
+   W->out.sized = 0;
 
    free_macros(W->octet->next);
    W->octet->next = NULL;
 }
 
 
+/* Reset all request data: args, cookies, headers, unparsed
+   dynamic content, and any macro values held in the arena.
+   With an arena the memory is released in one step. */
+
+void WebTemplate_reset(WebTemplate W)
+{
+   TmplMacro m;
+
+   WebTemplate_reset_output(W);
+   free_macros(W->arg->next);
+   W->arg->next = NULL;
+   free_macros(W->in_cookie->next);
+   W->in_cookie->next = NULL;
+   clear_dynamic(W);
+   if (W->arena) {   /* as the parses' values would have been */
+      while (W->defer) free_defer(W, W->defer);
+   }
+   for (m=W->macros->first;m;m=m->next) {
+      if (m->own==MV_ARENA) set_macro_value(m, NULL);
+   }
+   if (W->arena) arena_reset(W->arena);
+}
+
+/* Keep request data in an arena of 'chunk' byte blocks.
+   A zero chunk size turns the arena off. */
+
+void WebTemplate_set_arena(WebTemplate W, size_t chunk)
+{
+   if (W->arena) {
+      WebTemplate_reset(W);
+      free_arena(W->arena);
+      W->arena = NULL;
+   }
+   clear_error_string(W);
+   if (chunk) W->arena = new_arena(chunk);
+}
+
+/* Install allocation functions for the library.
+   Call before creating any WebTemplate.  NULLs restore the defaults. */
+
+void WebTemplate_set_allocator(void *(*m)(size_t), void *(*r)(void *, size_t),
+     void (*f)(void *))
+{
+   tpl_malloc = m? m: malloc;
+   tpl_realloc = r? r: realloc;
+   tpl_free = f? f: free;
+}
+
+
 /* -- convenience functions */
 
 /* convert html character encoding to plaintext */
@@ -1249,9 +4586,9 @@ void WebTemplate_scan_arg(WebTemplate W, char *str)
 {
    clear_error_string(W);
    if (str) {
-     char *a = strdup(str);
+     char *a = tpl_strdup(str);
      scan_arg(W, a);
-     free (a);
+     tpl_free (a);
    }
 }
 
@@ -1259,9 +4596,15 @@ char *WebTemplate_macro_value(WebTemplate W, char *name)
 {
    TmplMacro m;
    clear_error_string(W);
-   m = find_macro(W->macros, name);
-   if (m && m->value) return (strdup(m->value));
-   else return (NULL);
+   m = find_indexed_macro(W->macros, name);
+   if (m && m->type==TM_TMPL) render_defer(W, m->defer);
+   if (m) format_macro(m);
+   if (m && m->value) {
+      char *v = (char*) malloc(m->len+1);
+      memcpy(v, m->value, m->len);
+      v[m->len] = '\0';
+      return (v);
+   } else return (NULL);
 }
 
 
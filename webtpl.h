@@ -25,80 +25,456 @@
 /* Template macro definition */
 
 #define TM_TEXT   1
-#define TM_TMPL   2
+#define TM_TMPL   2         /* a deferred parse, rendered when used */
+#define TM_LONG   3         /* typed values, formatted when used */
+#define TM_DOUBLE 4
+#define TM_TIME   5
+
+/* Macro value ownership */
+
+#define MV_OWN    0         /* malloc'd, freed with the macro */
+#define MV_REF    1         /* borrowed from the caller */
+#define MV_ARENA  2         /* in the request arena */
 
 typedef struct TmplMacro__ {
   struct TmplMacro__ *next;
   char *name;
   char *value;
   size_t len;
+  int own;                  /* MV_xxx */
+  int type;                 /* TM_xxx */
+  union {
+    long l;
+    double d;
+    time_t t;
+  } num;                    /* value of a typed macro */
+  int prec;                 /* digits after the point (double) */
+  char *fmt;                /* strftime format (time) */
+  char nbuf[64];            /* formatted typed value */
   char *xtra1;
   char *xtra2;
+  unsigned int hash;        /* hash of name (indexed macros) */
+  int index;                /* in a template tree's macro list */
+  struct TmplDefer__ *defer;   /* its parse (TM_TMPL) */
+  int refs;                 /* deferred parses using an old value */
 } TmplMacro_, *TmplMacro;
 
+/* Macro table.  Macros are chained in the order they were defined
+   and indexed by an open-addressed hash of their names. */
+
+typedef struct TmplTable__ {
+  TmplMacro first;          /* definition order */
+  TmplMacro last;
+  TmplMacro *slot;          /* hash index, size is a power of 2 */
+  size_t nslot;
+  size_t count;
+} TmplTable_, *TmplTable;
+
 /* Template item */
 
 #define TI_TEXT    1
 #define TI_MACRO   2
 #define TI_DYNAMIC 3
-#define TI_DTEXT   4
+
+/* Macro item filters: {NAME|html} etc. */
+
+#define TF_NONE    0
+#define TF_HTML    1
+#define TF_URL     2
+#define TF_JS      3
 
 typedef struct TmplItem__ {
-  struct TmplItem__ *next;
-  void  *parent;            /* parent template */
   int    type;
-  void  *content;           /* text, macro name, dynamic block template */
+  void  *content;           /* text, dynamic block template */
   size_t len;               /* length of text item */
+  int    index;             /* of a macro in its tree, or of a block */
+  int    filter;            /* TF_xxx, of a macro item */
 } TmplItem_, *TmplItem;
 
-/* Template */
+/* A text item gzipped on its own: raw deflate blocks that end on
+   a byte and use no earlier text, so they fit in any gzip stream. */
+
+#define TPL_ZTEXT_MIN 1024  /* shorter text is gzipped with the page */
+
+typedef struct TmplZText__ {
+  char *data;               /* or NULL if it was not compressed */
+  size_t len;
+  unsigned long crc;        /* crc32 of the text */
+} TmplZText_, *TmplZText;
+
+/* Template.  The items are one array.  Once the tree is finished
+   adjacent text is merged, and the macros and blocks are listed
+   separately, so sizing a render need not look at the text. */
 
 typedef struct Template__ {
-  struct Template__ *next;     /* next template ( if plain ) */
-  void *base;
+  struct Template__ *parent;   /* enclosing template ( if dynamic ) */
   char *name;
-  TmplItem pip;             /* parent item pointer ( if dynamic ) */
+  int index;                /* of its dynamic text ( if dynamic ) */
   TmplItem item;            /* template items */
-  TmplItem last;            /* end of item list */
+  int nitem;
+  int aitem;                /* space, while being read */
+  size_t slen;              /* length of all the text items */
+  int *var;                 /* the macro and block items */
+  int nvar;
+  int *used;                /* the macros, by tree index, once each */
+  int nused;
+  char *text;               /* merged text that had to be copied */
+  TmplZText ztext;          /* its text items gzipped, by item */
 } Template_, *Template;
-#define MACROS(T) (((TmplBase)T->base)->macros)
 
+/* Request arena.  Request data is bump-allocated from a chain of
+   chunks.  A reset rewinds to the first chunk; chunks are kept. */
+
+typedef struct TmplChunk__ {
+  struct TmplChunk__ *next;
+  size_t size;              /* bytes of data */
+  size_t used;
+} TmplChunk_, *TmplChunk;
+
+typedef struct TmplArena__ {
+  TmplChunk first;
+  TmplChunk cur;            /* chunk being allocated from */
+  char *last;               /* most recent allocation */
+  size_t chunk;             /* default chunk size */
+} TmplArena_, *TmplArena;
+
+/* Compiled template image.  A head, then template records, then
+   item records, then a string pool.  References are offsets into
+   the pool, so the image can be mapped anywhere and shared. */
+
+#define TPL_IMAGE_MAGIC "WTPLIMG1"
+#define TPL_IMAGE_VERSION 1
+#define TPL_IMAGE_ORDER 0x01020304
+#define TPL_NONE 0xffffffff
+
+typedef struct TmplImageHead__ {
+  char magic[8];
+  unsigned int version;
+  unsigned int order;       /* TPL_IMAGE_ORDER, as the writer stored it */
+  unsigned int ntemplate;   /* template records */
+  unsigned int nitem;       /* item records */
+  unsigned int pool;        /* offset of the string pool */
+  unsigned int size;        /* of the whole image */
+} TmplImageHead_;
+
+typedef struct TmplImageTemplate__ {
+  unsigned int name;        /* pool offset */
+  unsigned int plain;       /* 0 if a dynamic block */
+  unsigned int item;        /* first item record */
+  unsigned int nitem;
+} TmplImageTemplate_;
+
+typedef struct TmplImageItem__ {
+  unsigned int type;        /* TI_xxx */
+  unsigned int filter;      /* TF_xxx */
+  unsigned int off;         /* text or macro name, or template record */
+  unsigned int len;         /* of text */
+  unsigned int value;       /* macro's default value, or TPL_NONE */
+} TmplImageItem_;
+
+/* An image being built */
+
+typedef struct TmplImageBuild__ {
+  TmplImageTemplate_ *tmpl;
+  unsigned int ntmpl, atmpl;
+  TmplImageItem_ *item;
+  unsigned int nitem, aitem;
+  char *pool;
+  size_t npool, apool;
+} TmplImageBuild_, *TmplImageBuild;
+
+/* A loaded image.  Templates made from it point into it. */
+
+typedef struct TmplImage__ {
+  int refs;                 /* trees using the image */
+  char *base;
+  size_t size;
+  int mapped;               /* else allocated */
+} TmplImage_, *TmplImage;
+
+/* A parsed template file.  A tree is never changed once built.
+   It is shared by every instance using it, and freed when the
+   last reference is released. */
+
+typedef struct TmplTree__ {
+  int refs;
+  Template root;
+  TmplTable macros;         /* macros used, with default values */
+  TmplMacro *mac;           /* the same, by index */
+  int nmacro;
+  int ndyn;                 /* dynamic blocks */
+  char *src;                /* file text, items point into it */
+  TmplImage image;          /* or the image they point into */
+  struct TmplTree__ **inc;  /* included files, held */
+  int ninc;
+  char *path;               /* of an included file */
+  char *cstart;             /* comment markers it was read with */
+  char *cend;
+  time_t mtime;             /* that file, when read */
+  long mtime_ns;
+  off_t size;
+  ino_t ino;
+} TmplTree_, *TmplTree;
+
+/* A resolved dynamic block.  It is good while its tree is
+   the one the instance is using. */
+
+typedef struct TmplDynHandle__ {
+  struct TmplDynHandle__ *next;
+  int slot;
+  TmplTree tree;            /* held */
+  Template T;
+} TmplDynHandle_, *TmplDynHandle;
+
+/* A dynamic block's row source.  Its rows are pulled as the
+   block's parent is rendered: 'fn' sets up a row and returns
+   non-zero, or returns zero when there are no more.  Only a
+   written parent streams them; a parse holds them all. */
+
+typedef int (*TmplRowFn)(void *W, void *ctx);
+
+typedef struct TmplSource__ {
+  struct TmplSource__ *next;
+  TmplTree tree;            /* held */
+  Template T;
+  TmplRowFn fn;
+  void *ctx;
+} TmplSource_, *TmplSource;
+
+/* Template set.  Each named template has a slot, which holds its
+   current tree.  Many instances may share a set.  The lock is held
+   only to find a slot or to swap its tree. */
+
+typedef struct TmplSlot__ {
+  char *name;
+  TmplTree tree;
+  char *path;               /* source file, if reloadable */
+  char *cstart;             /* comment markers it was read with */
+  char *cend;
+  time_t mtime;             /* source file, when read */
+  long mtime_ns;
+  off_t size;
+  ino_t ino;
+  time_t checked;           /* when the file was last checked */
+} TmplSlot_, *TmplSlot;
+
+typedef struct TmplSet__ {
+  int refs;
+  int lock;
+  TmplSlot *slot;
+  int nslot;
+  int reload;               /* seconds between file checks, 0 for none */
+  TmplTree *inc;            /* included files, read once */
+  int ninc;
+  int precompress;          /* gzip the text of templates loaded */
+} TmplSet_, *TmplSet;
+
+/* Dynamic text of a block, waiting to be parsed into its parent */
+
+typedef struct TmplDyn__ {
+  char *text;
+  size_t len;
+  size_t size;
+  int own;                  /* MV_xxx */
+} TmplDyn_, *TmplDyn;
+
+/* Output.  It goes to a function, or to an fd, through a buffer. */
+
+#define TPL_OUT_SIZE 16384  /* default buffer size */
+#define TPL_OUT_MIN  256
+
+typedef int (*TmplSinkFn)(void *ctx, char *data, size_t len);
+
+/* The gzip stage.  Output is deflated on to the buffer, or held
+   to be sized for a Content-Length. */
+
+typedef struct TmplGzip__ {
+  void *zs;                 /* z_stream, of raw deflate */
+  int level;
+  int on;                   /* a gzip member is open */
+  unsigned long crc;        /* crc32 of the text in it */
+  unsigned long total;
+  int dirty;                /* text in since the last full flush */
+  int held;                 /* output goes to 'hold' */
+  char *hold;
+  size_t hlen;
+  size_t hsize;
+} TmplGzip_, *TmplGzip;
+
+/* xxHash64 of a page, for its ETag */
+
+typedef struct TmplHash__ {
+  unsigned long long v[4];
+  unsigned long long total;
+  unsigned char buf[32];    /* input short of a stripe */
+  size_t len;
+} TmplHash_, *TmplHash;
+
+typedef struct TmplOut__ {
+  TmplSinkFn fn;            /* or NULL to write to the fd */
+  void *ctx;
+  int fd;
+  char *buf;                /* 'size' bytes, when first used */
+  size_t size;
+  size_t len;
+  int err;                  /* errno of a failed write */
+  int gzip;                 /* level, if the page is gzipped */
+  TmplGzip gz;              /* when first used */
+  char etag[24];            /* for the page's headers, or empty */
+  int not_modified;         /* a 304 was sent for the page */
+  int sized;                /* a Content-Length was sent for the page */
+} TmplOut_, *TmplOut;
+
+/* A page rendered to pieces, for WebTemplate_render_iov.
+   Filtered values are escaped into 'text'. */
+
+typedef struct TmplIov__ {
+  struct iovec *iov;        /* 'n' pieces, room for 'size' */
+  int n;
+  int size;
+  char *text;               /* 'len' bytes, room for 'tsize' */
+  size_t len;
+  size_t tsize;
+} TmplIov_, *TmplIov;
+
+/* An instance's use of a slot.  The instance keeps the tree it
+   bound to while any dynamic text for it is pending. */
+
+typedef struct TmplBind__ {
+  TmplTree tree;            /* held */
+  TmplMacro *mac;           /* instance macros, by tree index */
+  TmplDyn dyn;              /* dynamic text, by block index */
+} TmplBind_, *TmplBind;
+
+/* A deferred parse.  It keeps what the template was parsed with:
+   the macros by tree index, and its blocks' dynamic text.
+   A macro it uses is not changed while it waits. */
+
+typedef struct TmplDefer__ {
+  struct TmplDefer__ *next;
+  TmplMacro m;              /* whose value it is */
+  Template T;
+  TmplBind_ bind;           /* tree held, mac and dyn its own */
+} TmplDefer_, *TmplDefer;
+
+/* A template rendered with some values of the macros it uses.
+   The key and text follow the record. */
+
+typedef struct TmplFrag__ {
+  struct TmplFrag__ *next;     /* in its hash slot */
+  struct TmplFrag__ *newer;    /* most recently used first */
+  struct TmplFrag__ *older;
+  TmplTree tree;            /* held */
+  Template T;
+  unsigned long long hash;  /* of T and the key */
+  char *key;                /* the values used, each after its length */
+  size_t klen;
+  char *text;
+  size_t len;
+} TmplFrag_, *TmplFrag;
+
+/* Rendered templates, kept to 'limit' bytes.  The least recently
+   used go first. */
+
+typedef struct TmplCache__ {
+  TmplFrag *slot;           /* by hash, size is a power of 2 */
+  size_t nslot;
+  size_t count;
+  TmplFrag newest;
+  TmplFrag oldest;
+  size_t size;              /* bytes held */
+  size_t limit;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long long hash;  /* of the last lookup */
+  int keyed;                /* the last lookup can be kept */
+} TmplCache_, *TmplCache;
 
 typedef struct WebTemplate__ {
-  Template template;
-  TmplMacro macros;
+  TmplSet set;              /* templates, maybe shared */
+  TmplBind bind;            /* by slot */
+  int nbind;
+  TmplDynHandle dhandle;    /* dynamic block handles given out */
+  TmplSource source;        /* dynamic blocks with row sources */
+  TmplTable macros;
   TmplMacro arg;            /* form and url args (decoded) */
   TmplMacro in_cookie;      /* cookies (incoming) */
   TmplMacro header;         /* headers (outgoing) */
   TmplMacro octet;          /* octet data (incoming) */
   int header_sent;
-  int fd;                   /* usually just stdout */
+  int content_length;       /* send Content-Length with the page */
+  int compress;             /* gzip level for pages, or 0 */
+  int etag;                 /* send an ETag, and 304 on a match */
+  TmplOut_ out;             /* usually just stdout */
+  TmplIov_ iov;             /* last page rendered to pieces */
   int cip;                  /* 'comments' in-progress */
+  int include;              /* depth of included files being read */
   char *cstart;             /* text to signal start-of-comment */
   size_t lcstart;
   char *cend;               /* text to signal end-of-comment */
   size_t lcend;
   char *error_string;       /* text of error */
+  TmplArena arena;          /* request data, if enabled */
+  TmplDefer defer;          /* parses not yet rendered */
+  int deferred;             /* defer parses */
+  TmplCache cache;          /* rendered parses, if enabled */
 } WebTemplate_, *WebTemplate;
   
 #else /* LIBRARY */
 
 #include <stdio.h>
 #include <time.h>
+#ifndef WIN32
+#include <sys/uio.h>
+#else
+struct iovec { void *iov_base; size_t iov_len; };
+#endif
 
 typedef void *WebTemplate;
+typedef void *WebTemplateMacro;
+typedef void *WebTemplateSet;
+typedef int (*WebTemplateSink)(void *ctx, char *data, size_t len);
+typedef void *WebTemplateDynamic;
+typedef int (*WebTemplateRows)(WebTemplate W, void *ctx);
 WebTemplate WebTemplate_new();
 WebTemplate newWebTemplate();
+WebTemplateSet WebTemplate_get_set(WebTemplate W);
+WebTemplate WebTemplate_new_with_set(WebTemplateSet S);
+void WebTemplate_free_set(WebTemplateSet S);
 void WebTemplate_free();
 void freeWebTemplate();
 char *WebTemplate_macro_value(WebTemplate, char *);
 int WebTemplate_get_by_fd(WebTemplate W, char *name, int fd);
 int WebTemplate_get_by_fp(WebTemplate W, char *name, FILE *f);
 int WebTemplate_get_by_name(WebTemplate W, char *name, char *filename);
+int WebTemplate_save_image(WebTemplate W, char *filename);
+int WebTemplate_load_image(WebTemplate W, char *filename);
+void WebTemplate_set_reload(WebTemplate W, int seconds);
 void WebTemplate_assign(WebTemplate W, char *name, char *value);
 void WebTemplate_assign_int(WebTemplate W, char *name, int value);
+void WebTemplate_assign_n(WebTemplate W, char *name, char *value, size_t len);
+void WebTemplate_assign_ref(WebTemplate W, char *name, char *value, size_t len);
+WebTemplateMacro WebTemplate_macro_handle(WebTemplate W, char *name);
+void WebTemplate_assign_h(WebTemplate W, WebTemplateMacro h, char *value);
+void WebTemplate_assign_int_h(WebTemplate W, WebTemplateMacro h, int value);
+void WebTemplate_assign_long(WebTemplate W, char *name, long value);
+void WebTemplate_assign_long_h(WebTemplate W, WebTemplateMacro h, long value);
+void WebTemplate_assign_double(WebTemplate W, char *name, double value, int prec);
+void WebTemplate_assign_double_h(WebTemplate W, WebTemplateMacro h,
+     double value, int prec);
+void WebTemplate_assign_time(WebTemplate W, char *name, time_t value, char *fmt);
 int WebTemplate_parse_dynamic(WebTemplate W, char *dname);
+WebTemplateDynamic WebTemplate_dynamic_handle(WebTemplate W, char *dname);
+void WebTemplate_free_dynamic_handle(WebTemplate W, WebTemplateDynamic h);
+int WebTemplate_parse_dynamic_h(WebTemplate W, WebTemplateDynamic h);
+int WebTemplate_parse_dynamic_rows(WebTemplate W, char *dname, char **columns,
+      int ncols, char ***values, size_t **lengths, int nrows);
+int WebTemplate_set_row_source(WebTemplate W, char *dname, WebTemplateRows fn, void *ctx);
 int WebTemplate_parse(WebTemplate W, char *mname, char *tname);
+void WebTemplate_set_deferred(WebTemplate W, int on);
+void WebTemplate_set_cache(WebTemplate W, size_t size);
+void WebTemplate_get_cache_stats(WebTemplate W, unsigned long *hits,
+     unsigned long *misses);
 
 void WebTemplate_add_header(WebTemplate W, char *name, char *value);
 void WebTemplate_set_cookie(WebTemplate W, char *name, char *argvalue,
@@ -112,15 +488,28 @@ int WebTemplate_get_octet_arg(WebTemplate W, char *name,
 char *WebTemplate_get_next_arg(WebTemplate W, int *n, char **v);
 char *WebTemplate_get_cookie(WebTemplate W, char *name);
 void WebTemplate_set_output(WebTemplate W, int fd);
+void WebTemplate_set_sink(WebTemplate W, WebTemplateSink fn, void *ctx);
+void WebTemplate_set_output_buffer(WebTemplate W, size_t size);
 void WebTemplate_set_noheader(WebTemplate W);
 int WebTemplate_header(WebTemplate W);
+void WebTemplate_set_content_length(WebTemplate W, int on);
+int WebTemplate_set_compression(WebTemplate W, int level);
+void WebTemplate_set_precompress(WebTemplate W, int on);
+void WebTemplate_set_etag(WebTemplate W, int on);
 int WebTemplate_write(WebTemplate W, char *name);
+int WebTemplate_write_template(WebTemplate W, char *tname);
+int WebTemplate_render_iov(WebTemplate W, char *tname, struct iovec **iov, int *n);
+int WebTemplate_finish_output(WebTemplate W);
 void WebTemplate_reset_output(WebTemplate W);
 char *WebTemplate_html2text(char *s);
 char *WebTemplate_text2html(char *s);
 void WebTemplate_scan_arg(WebTemplate W, char *str);
 void WebTemplate_set_comments(WebTemplate W, char *start, char *end);
 char *WebTemplate_get_error_string(WebTemplate W);
+void WebTemplate_set_allocator(void *(*m)(size_t), void *(*r)(void *, size_t),
+     void (*f)(void *));
+void WebTemplate_set_arena(WebTemplate W, size_t chunk);
+void WebTemplate_reset(WebTemplate W);
 
 extern char *webtpl_version;
 
@@ -0,0 +1,80 @@
+/* ========================================================================
+ * Copyright (c) 2004-2008 The University of Washington
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * ========================================================================
+ */
+
+
+/* webtpl-compile: parse template files into a compiled image
+   for WebTemplate_load_image.
+
+   usage: webtpl-compile [-c start] [-e end] image name file [name file ...]
+
+   -c and -e set the comment delimiters for the files that follow.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "webtpl.h"
+
+static void usage()
+{
+  fprintf(stderr,
+     "usage: webtpl-compile [-c start] [-e end] image name file [name file ...]\n");
+}
+
+int main(int argc, char **argv)
+{
+  WebTemplate W;
+  char *image = NULL;
+  char *cstart = NULL;
+  char *cend = NULL;
+  int i;
+
+  if (argc<4) {
+     usage();
+     return (1);
+  }
+  W = WebTemplate_new();
+  for (i=1; i<argc; i++) {
+     if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "-e")) {
+        if (i+1>=argc) break;
+        if (argv[i][1]=='c') cstart = argv[i+1];
+        else cend = argv[i+1];
+        WebTemplate_set_comments(W, cstart, cend);
+        i++;
+     } else if (!image) {
+        image = argv[i];
+     } else if (i+1<argc) {
+        if (WebTemplate_get_by_name(W, argv[i], argv[i+1])) {
+           fprintf(stderr, "webtpl-compile: %s: %s\n", argv[i+1],
+                   WebTemplate_get_error_string(W));
+           return (1);
+        }
+        i++;
+     } else break;
+  }
+  if (i<argc || !image) {
+     usage();
+     return (1);
+  }
+  if (WebTemplate_save_image(W, image)) {
+     fprintf(stderr, "webtpl-compile: %s: %s\n", image,
+             WebTemplate_get_error_string(W));
+     return (1);
+  }
+  WebTemplate_free(W);
+  return (0);
+}